@@ -0,0 +1,109 @@
+#ifndef _BOUNDED_QUEUE_H
+#define _BOUNDED_QUEUE_H
+
+#include <glib.h>
+#include <deque>
+
+//A fixed capacity queue between pipeline stages. Producers block while it is
+//full, so a fast stage cannot run far ahead of a slow one.
+template<class T> class BoundedQueue
+{
+public:
+	BoundedQueue(size_t capacity)
+	{
+		this->capacity = capacity > 0 ? capacity : 1;
+		this->closed = false;
+		g_mutex_init(&this->mutex);
+		g_cond_init(&this->notEmpty);
+		g_cond_init(&this->notFull);
+	}
+
+	virtual ~BoundedQueue()
+	{
+		g_cond_clear(&this->notFull);
+		g_cond_clear(&this->notEmpty);
+		g_mutex_clear(&this->mutex);
+	}
+
+	//Blocks while full. Returns false, without queuing, once closed.
+	bool Push(const T &item)
+	{
+		g_mutex_lock (&this->mutex);
+		while(!this->closed && this->items.size() >= this->capacity)
+			g_cond_wait (&this->notFull, &this->mutex);
+		bool ok = !this->closed;
+		if(ok)
+			this->items.push_back(item);
+		g_mutex_unlock (&this->mutex);
+
+		if(ok)
+			g_cond_signal (&this->notEmpty);
+		return ok;
+	}
+
+	//Does not block. Returns false, without queuing, if full or closed.
+	bool TryPush(const T &item)
+	{
+		g_mutex_lock (&this->mutex);
+		bool ok = !this->closed && this->items.size() < this->capacity;
+		if(ok)
+			this->items.push_back(item);
+		g_mutex_unlock (&this->mutex);
+
+		if(ok)
+			g_cond_signal (&this->notEmpty);
+		return ok;
+	}
+
+	//Blocks while empty. Returns false once closed.
+	bool Pop(T &itemOut)
+	{
+		g_mutex_lock (&this->mutex);
+		while(!this->closed && this->items.empty())
+			g_cond_wait (&this->notEmpty, &this->mutex);
+		bool ok = !this->closed;
+		if(ok)
+		{
+			itemOut = this->items.front();
+			this->items.pop_front();
+		}
+		g_mutex_unlock (&this->mutex);
+
+		if(ok)
+			g_cond_signal (&this->notFull);
+		return ok;
+	}
+
+	//Does not block; used to drain items left after closing
+	bool TryPop(T &itemOut)
+	{
+		g_mutex_lock (&this->mutex);
+		bool ok = !this->items.empty();
+		if(ok)
+		{
+			itemOut = this->items.front();
+			this->items.pop_front();
+		}
+		g_mutex_unlock (&this->mutex);
+		return ok;
+	}
+
+	//Wakes every blocked producer and consumer
+	void Close()
+	{
+		g_mutex_lock (&this->mutex);
+		this->closed = true;
+		g_mutex_unlock (&this->mutex);
+		g_cond_broadcast (&this->notEmpty);
+		g_cond_broadcast (&this->notFull);
+	}
+
+private:
+	GMutex mutex;
+	GCond notEmpty, notFull;
+	std::deque<T> items;
+	size_t capacity;
+	bool closed;
+};
+
+#endif //_BOUNDED_QUEUE_H
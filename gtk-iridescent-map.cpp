@@ -3,15 +3,12 @@
 #include <iostream>
 #include <cmath>
 #include <stdexcept>
+#include <cstdlib>
 #include <fstream>
 
-#include "iridescent-map/LabelEngine.h"
-#include "iridescent-map/Regrouper.h"
-#include "iridescent-map/ReadInputO5m.h"
-#include "iridescent-map/Transform.h"
-#include "iridescent-map/drawlib/drawlibcairo.h"
-#include "iridescent-map/MapRender.h"
-#include "iridescent-map/Coast.h"
+#include "tile-service.h"
+#include "tile-render.h"
+#include "tile-archive.h"
 
 using namespace std;
 
@@ -19,96 +16,33 @@ typedef std::pair<int, int> IntPair;
 
 G_DEFINE_TYPE( IridescentMap, iridescent_map, GTK_TYPE_DRAWING_AREA )
 
-class Resource
+enum
 {
-public:
-	LabelsByImportance labelsByImportance;
-	cairo_surface_t *roughLabelsSurface, *shapesSurface, *labelsSurface;
-	bool inputError;
-	bool labelsSurfacePending, shapesSurfacePending;
-	bool shapeTaskAssigned, labelTaskAssigned;
-
-	Resource();
-	Resource(const class Resource &a);
-	virtual ~Resource();
+	PROP_0,
+	PROP_TILE_ARCHIVE,
+	N_PROPERTIES
 };
 
-Resource::Resource()
-{
-	shapesSurface = NULL;
-	shapesSurfacePending = false;
-	roughLabelsSurface= NULL;
-	labelsSurface = NULL;
-	labelsSurfacePending = false;
-	inputError = false;
-	shapeTaskAssigned = false;
-	labelTaskAssigned = false;
-}
+static GParamSpec *obj_properties[N_PROPERTIES] = { NULL, };
 
-Resource::Resource(const class Resource &a)
-{
-	shapesSurface = a.shapesSurface;
-	roughLabelsSurface = a.roughLabelsSurface;
-	labelsSurface = a.labelsSurface;
-
-	labelsByImportance = a.labelsByImportance;
-	labelsSurfacePending = a.labelsSurfacePending;
-	shapesSurfacePending = a.shapesSurfacePending;
-	inputError = a.inputError;
-	shapeTaskAssigned = a.shapeTaskAssigned;
-	labelTaskAssigned = a.labelTaskAssigned;
-}
-
-Resource::~Resource()
-{
-	labelsByImportance.clear();
-
-	if(shapesSurface != NULL)
-		cairo_surface_destroy(shapesSurface);
-	shapesSurface = NULL;
-	if(roughLabelsSurface != NULL)
-		cairo_surface_destroy(roughLabelsSurface);
-	roughLabelsSurface = NULL;
-	if(labelsSurface != NULL)
-		cairo_surface_destroy(labelsSurface);
-	labelsSurface = NULL;
-
-}
-
-// ************************************************************
-typedef map<int, map<int, map<int, Resource> > > Resources; //First index is zoom, then x, then y
-gpointer WorkerThread (gpointer data);
 static void iridescent_map_view_changed (GtkWidget *widget);
-enum TaskType
-{
-	TASK_INVALID,
-	TASK_SHAPES,
-	TASK_LABELS
-};
-enum WidgetLayers
-{
-	WIDGET_LAYER_SHAPES,
-	WIDGET_LAYER_ROUGH_LABELS,
-	WIDGET_LAYER_LABELS
-};
+static gboolean iridescent_map_resources_changed (gpointer data);
+static void iridescent_map_scale_factor_changed (GObject *object, GParamSpec *pspec, gpointer data);
 
 class _IridescentMapPrivate
 {
 public:
-	//Local variables (not thread safe!)
+	//Only accessed from the main loop; tiles live in the shared TileService
 	std::map<int, IntPair> pressPos;
 	double preMoveX, preMoveY, preZoom;
 	GtkWidget *parent;
 
-	//Start of memory protected resources and controls
-	GThread *workerThread;
-	GMutex *mutex;
-	GCond *stopWorkerCond;
-	bool stopWorker;
 	double currentX, currentY, currentZoom;
-	std::vector<double> viewBbox; //left,bottom,right,top
-	Resources resources;
-	//End of memory protected resources
+	std::vector<double> viewBbox; //left,bottom,right,top, in tiles
+	std::string style;
+	int scaleFactor; //Device pixels per widget pixel
+	std::string archiveFilename; //Pre-rendered tiles, tried before rendering
+	int viewId; //Subscription to the shared tile service
 
 	_IridescentMapPrivate(GtkWidget *parent)
 	{
@@ -119,37 +53,51 @@ public:
 		this->preMoveX = 0.0;
 		this->preMoveY = 0.0;
 		this->preZoom = 0;
-		this->stopWorker = false;
-		this->mutex = new GMutex;
-		g_mutex_init(this->mutex);
-		this->stopWorkerCond = new GCond;
-		g_cond_init (this->stopWorkerCond);
-		this->workerThread = g_thread_new("IridescentMapWorker",
-              WorkerThread,
-              this);
+		this->style = "iridescent-testdata/";
+		this->scaleFactor = 1;
+		this->viewId = TileService::GetInstance().AddView(this->style, 
+			iridescent_map_resources_changed, this);
 	}
 
 	virtual ~_IridescentMapPrivate()
 	{
-		g_mutex_lock (this->mutex);
-		this->stopWorker = true;
-		g_mutex_unlock (this->mutex);
-		g_cond_signal (this->stopWorkerCond);
-		
-		g_thread_join (workerThread);
-		g_thread_unref(workerThread);
-		workerThread = NULL;
-
-		g_mutex_lock (this->mutex);
-		resources.clear();
-		g_mutex_unlock (this->mutex);
-
-		g_cond_clear (this->stopWorkerCond);
-		delete this->stopWorkerCond;
-		this->stopWorkerCond = NULL;
-		g_mutex_clear (this->mutex);
-		delete this->mutex;
-		this->mutex = NULL;
+		TileService::GetInstance().RemoveView(this->viewId);
+	}
+
+	//Tiles are rendered at the device resolution, so they are drawn without rescaling
+	int TilePixels() const
+	{
+		return RENDER_TILE_SIZE * this->scaleFactor;
+	}
+
+	StyleKey Key() const
+	{
+		return StyleKey(this->style, TilePixels());
+	}
+
+	//Top left corner of a tile, in widget pixels
+	void TileToWidget(int x, int y, const GtkAllocation &allocation, double &pxOut, double &pyOut) const
+	{
+		pxOut = round((x - this->currentX) * RENDER_TILE_SIZE) + allocation.width/2;
+		pyOut = round((y - this->currentY) * RENDER_TILE_SIZE) + allocation.height/2;
+	}
+
+	//Distance in map tiles
+	double WidgetToTiles(double distance) const
+	{
+		return distance / RENDER_TILE_SIZE;
+	}
+
+	//Tiles in view
+	void VisibleTiles(const GtkAllocation &allocation, 
+		int &minxOut, int &maxxOut, int &minyOut, int &maxyOut) const
+	{
+		double halfWidthNumTiles = WidgetToTiles(allocation.width / 2.0);
+		double halfHeightNumTiles = WidgetToTiles(allocation.height / 2.0);
+		minxOut = (int)floor(this->currentX - halfWidthNumTiles);
+		maxxOut = (int)floor(this->currentX + halfWidthNumTiles);
+		minyOut = (int)floor(this->currentY - halfHeightNumTiles);
+		maxyOut = (int)floor(this->currentY + halfHeightNumTiles);
 	}
 };
 
@@ -166,6 +114,8 @@ static void iridescent_map_init( IridescentMap* self )
 	gtk_widget_add_events(widget, GDK_BUTTON_RELEASE_MASK);
 	gtk_widget_add_events(widget, GDK_BUTTON_MOTION_MASK);
 	gtk_widget_add_events(widget, GDK_SCROLL_MASK);
+
+	g_signal_connect(widget, "notify::scale-factor", G_CALLBACK(iridescent_map_scale_factor_changed), NULL);
 }
 
 void iridescent_map_destroy(GtkWidget *widget)
@@ -194,10 +144,31 @@ void iridescent_map_get_preferred_width(GtkWidget *widget,
 	*natural_width = 100;
 }
 
-bool draw_at_alternate_zoom(cairo_t *cr, Resources &resources, int x, int y, double px, double py, int zoom, int layer)
+//A surface to be painted onto the widget. Holds its own reference so painting 
+//can happen after the resource lock is released.
+class TilePaint
 {
-	//Memory protected variables already locked by iridescent_map_draw!
-	bool foundAlt = false;
+public:
+	cairo_surface_t *surface;
+	double px, py, size; //Widget position and size of tile
+	double scale, offsetx, offsety; //Pattern transform when borrowing another zoom
+
+	TilePaint(cairo_surface_t *surface, double px, double py, double size)
+	{
+		this->surface = surface;
+		this->px = px;
+		this->py = py;
+		this->size = size;
+		this->scale = 1.0;
+		this->offsetx = 0.0;
+		this->offsety = 0.0;
+	}
+};
+
+cairo_surface_t *find_at_alternate_zoom(Resources &resources, int x, int y, int zoom, int layer, 
+	int tileSize, double &offsetxOut, double &offsetyOut)
+{
+	//Tile service already locked by iridescent_map_draw!
 	int altx = x, alty = y, altZoom = zoom;
 	altZoom --;
 	int altxrem = x % 2;
@@ -216,56 +187,40 @@ bool draw_at_alternate_zoom(cairo_t *cr, Resources &resources, int x, int y, dou
 			map<int, Resource>::iterator it2 = col.find(alty);
 			if(it2 != col.end())
 			{
-				Resource &r = it2->second;
-				cairo_surface_t *surface = NULL;
-				if(layer == WIDGET_LAYER_SHAPES) surface = r.shapesSurface;
-				if(layer == WIDGET_LAYER_LABELS) surface = r.labelsSurface;
-				if(layer == WIDGET_LAYER_ROUGH_LABELS) surface = r.roughLabelsSurface;
-				cairo_pattern_t *pattern = cairo_pattern_create_for_surface (surface);
-				
-				if(cairo_pattern_status(pattern)==CAIRO_STATUS_SUCCESS)
-				{
-					cairo_matrix_t mat;
-					cairo_matrix_init_scale (&mat,
-										0.5,
-										0.5);
-					cairo_matrix_translate (&mat, -px + altxrem * 640, -py + altyrem * 640);
-
-					cairo_pattern_set_matrix(pattern, &mat);
-					cairo_set_source (cr, pattern);
-					cairo_fill_preserve(cr);
-					foundAlt = true;
-				}
-
-				cairo_pattern_destroy (pattern);
-				if(foundAlt)
-					return foundAlt;
+				offsetxOut = altxrem * tileSize;
+				offsetyOut = altyrem * tileSize;
+				return it2->second.GetSurface(layer);
 			}
 		}
 	}
-	return false;
+	return NULL;
 }
 
-gboolean iridescent_map_draw(GtkWidget *widget,
-                                cairo_t *cr)
+bool draw_at_alternate_zoom(std::vector<class TilePaint> &paints, Resources &resources, int x, int y, double px, double py, int zoom, int layer, 
+	int tileSize)
 {
-	IridescentMap *self = IRIDESCENT_MAP(widget);
-	_IridescentMapPrivate *privateData = (_IridescentMapPrivate *)self->privateData;
+	class TilePaint paint(NULL, px, py, tileSize);
+	paint.surface = find_at_alternate_zoom(resources, x, y, zoom, layer, tileSize, paint.offsetx, paint.offsety);
+	if(paint.surface == NULL)
+		return false;
+	paint.scale = 0.5;
+	paints.push_back(paint);
+	return true;
+}
 
-	GtkAllocation allocation;
-	gtk_widget_get_allocation (widget, &allocation);
+//Collects the layers of the tiles in view, in paint order. Returns false if any
+//tile has no shapes of its own yet.
+bool collect_tile_paints(std::vector<class TilePaint> &paints, Resources &resources, 
+	const class _IridescentMapPrivate &priv, const GtkAllocation &allocation, bool useAlternateZoom)
+{
+	//Tile service already locked by iridescent_map_draw!
+	int minx = 0, maxx = 0, miny = 0, maxy = 0;
+	priv.VisibleTiles(allocation, minx, maxx, miny, maxy);
+	int roundedZoom = (int)round(priv.currentZoom);
+	int tileSize = RENDER_TILE_SIZE;
+	map<int, map<int, Resource> > &resourcesAtZoom = resources[roundedZoom];
+	bool covered = true;
 
-	cairo_save(cr);
-	
-	g_mutex_lock (privateData->mutex);
-	int minx = (int)floor(privateData->viewBbox[0]);
-	int maxx = (int)ceil(privateData->viewBbox[2]);
-	int miny = (int)floor(privateData->viewBbox[3]);
-	int maxy = (int)ceil(privateData->viewBbox[1]);
-	int roundedZoom = (int)round(privateData->currentZoom);
-	map<int, map<int, Resource> > &resourcesAtZoom = privateData->resources[roundedZoom];
-	
-	//Tiles currently in view
 	for(int x = minx; x <= maxx; x++)
 	{
 		map<int, Resource> &col = resourcesAtZoom[x];
@@ -273,73 +228,89 @@ gboolean iridescent_map_draw(GtkWidget *widget,
 		for(int y = miny; y <= maxy; y++)
 		{
 			Resource &r = col[y];
-
-			cairo_surface_t *shapesSurface = r.shapesSurface;
-			cairo_pattern_t *shapesPattern = cairo_pattern_create_for_surface (shapesSurface);
-
-			cairo_surface_t *roughLabelsSurface = r.roughLabelsSurface;
-			cairo_pattern_t *roughLabelsPattern = cairo_pattern_create_for_surface (roughLabelsSurface);
-
-			cairo_surface_t *labelsSurface = r.labelsSurface;
-			cairo_pattern_t *labelsPattern = cairo_pattern_create_for_surface (labelsSurface);
 			
-			double dx = x - privateData->currentX;
-			double dy = y - privateData->currentY;
-			double px = round(dx * 640.0) + allocation.width/2;
-			double py = round(dy * 640.0) + allocation.height/2;
-
-			cairo_matrix_t mat;
-			cairo_matrix_init_translate (&mat, -px, -py);
-
-			cairo_move_to(cr, px, 
-						py);
-			cairo_line_to(cr, px + 640, 
-						py);
-			cairo_line_to(cr, px + 640, 
-						py + 640);
-			cairo_line_to(cr, px + 0, 
-						py + 640);
-
-			if(cairo_pattern_status(shapesPattern)==CAIRO_STATUS_SUCCESS)
-			{
-				cairo_pattern_set_matrix(shapesPattern, &mat);
-				cairo_set_source (cr, shapesPattern);
-				cairo_fill_preserve(cr);
-			}
+			double px = 0.0, py = 0.0;
+			priv.TileToWidget(x, y, allocation, px, py);
+
+			cairo_surface_t *shapesSurface = r.GetSurface(WIDGET_LAYER_SHAPES);
+			if(shapesSurface == NULL)
+				shapesSurface = r.GetSurface(WIDGET_LAYER_DRAFT_SHAPES); //Until the full tile is ready
+			if(shapesSurface != NULL)
+				paints.push_back(TilePaint(shapesSurface, px, py, tileSize));
 			else
 			{
-				bool drawn = draw_at_alternate_zoom(cr, privateData->resources, x, y, px, py, roundedZoom, WIDGET_LAYER_SHAPES);
+				covered = false;
+				if(useAlternateZoom)
+					draw_at_alternate_zoom(paints, resources, x, y, px, py, roundedZoom, WIDGET_LAYER_SHAPES, tileSize);
 			}
-			cairo_pattern_destroy (shapesPattern);
 
-			if(cairo_pattern_status(labelsPattern)==CAIRO_STATUS_SUCCESS)
-			{
-				cairo_pattern_set_matrix(labelsPattern, &mat);
-				cairo_set_source (cr, labelsPattern);
-				cairo_fill_preserve(cr);
-			}
-			else if (cairo_pattern_status(roughLabelsPattern)==CAIRO_STATUS_SUCCESS)
-			{
-				//If final labels are not ready, use rough labels
-				cairo_pattern_set_matrix(roughLabelsPattern, &mat);
-				cairo_set_source (cr, roughLabelsPattern);
-				cairo_fill_preserve(cr);
-			}
-			else
+			if(r.labelsInShapes)
+				continue; //Archived tiles already include their labels
+
+			cairo_surface_t *labelsSurface = r.GetSurface(WIDGET_LAYER_LABELS);
+			if(labelsSurface == NULL)
+				labelsSurface = r.GetSurface(WIDGET_LAYER_ROUGH_LABELS); //If final labels are not ready, use rough labels
+			if(labelsSurface != NULL)
+				paints.push_back(TilePaint(labelsSurface, px, py, tileSize));
+			else if(useAlternateZoom)
 			{
-				bool drawn = draw_at_alternate_zoom(cr, privateData->resources, x, y, px, py, roundedZoom, WIDGET_LAYER_LABELS);
+				bool drawn = draw_at_alternate_zoom(paints, resources, x, y, px, py, roundedZoom, WIDGET_LAYER_LABELS, tileSize);
 				if(!drawn)
-					drawn = draw_at_alternate_zoom(cr, privateData->resources, x, y, px, py, roundedZoom, WIDGET_LAYER_ROUGH_LABELS);
+					drawn = draw_at_alternate_zoom(paints, resources, x, y, px, py, roundedZoom, WIDGET_LAYER_ROUGH_LABELS, tileSize);
 			}
+		}
+	}
+	return covered;
+}
+
+gboolean iridescent_map_draw(GtkWidget *widget,
+                                cairo_t *cr)
+{
+	IridescentMap *self = IRIDESCENT_MAP(widget);
+	_IridescentMapPrivate *privateData = (_IridescentMapPrivate *)self->privateData;
+
+	GtkAllocation allocation;
+	gtk_widget_get_allocation (widget, &allocation);
 
-			cairo_new_path (cr); //Clear current path
-			cairo_pattern_destroy (labelsPattern);
-			cairo_pattern_destroy (roughLabelsPattern);
+	std::vector<class TilePaint> paints, fallbackPaints;
+	class TileService &service = TileService::GetInstance();
+	
+	service.Lock();
+	Resources &resources = service.GetResources(privateData->Key());
+	bool covered = collect_tile_paints(paints, resources, *privateData, allocation, true);
+
+	//After a change of scale factor, the previous tiles are drawn 
+	//behind until the new ones cover the view
+	StyleKey fallbackKey;
+	Resources *fallback = NULL;
+	if(!covered && service.GetViewFallback(privateData->viewId, fallbackKey))
+		fallback = service.FindResources(fallbackKey);
+	if(fallback != NULL)
+		collect_tile_paints(fallbackPaints, *fallback, *privateData, allocation, false);
+	service.Unlock();
+	paints.insert(paints.begin(), fallbackPaints.begin(), fallbackPaints.end());
+
+	//Paint outside the lock so workers can publish tiles meanwhile. A surface's 
+	//user space is the size of its tile in widget pixels, whatever its resolution.
+	cairo_save(cr);
+	for(size_t i=0; i<paints.size(); i++)
+	{
+		class TilePaint &paint = paints[i];
+		cairo_pattern_t *pattern = cairo_pattern_create_for_surface (paint.surface);
+		if(cairo_pattern_status(pattern)==CAIRO_STATUS_SUCCESS)
+		{
+			cairo_matrix_t mat;
+			cairo_matrix_init_scale (&mat, paint.scale, paint.scale);
+			cairo_matrix_translate (&mat, -paint.px + paint.offsetx, -paint.py + paint.offsety);
+			cairo_pattern_set_matrix(pattern, &mat);
 
+			cairo_rectangle(cr, paint.px, paint.py, paint.size, paint.size);
+			cairo_set_source (cr, pattern);
+			cairo_fill(cr);
 		}
+		cairo_pattern_destroy (pattern);
+		cairo_surface_destroy (paint.surface);
 	}
-	g_mutex_unlock (privateData->mutex);
-
 	cairo_restore(cr);
 
 	return true; //stop other handlers from being invoked for the event
@@ -355,11 +326,9 @@ gboolean iridescent_map_button_press_event (GtkWidget *widget,
 	std::map<int, IntPair>::iterator it = privateData->pressPos.find(1);
 	if(it != privateData->pressPos.end())
 	{
-		g_mutex_lock (privateData->mutex);
 		privateData->preMoveX = privateData->currentX;
 		privateData->preMoveY = privateData->currentY;
 		privateData->preZoom = privateData->currentZoom;
-		g_mutex_unlock (privateData->mutex);
 	}
 
 	return true;
@@ -389,10 +358,8 @@ gboolean iridescent_map_motion_notify_event (GtkWidget *widget,
 		IntPair &startPos = it->second;
 		double dx = event->x - startPos.first;
 		double dy = event->y - startPos.second;
-		g_mutex_lock (privateData->mutex);
-		privateData->currentX = privateData->preMoveX - dx / 640.0;
-		privateData->currentY = privateData->preMoveY - dy / 640.0;
-		g_mutex_unlock (privateData->mutex);
+		privateData->currentX = privateData->preMoveX - privateData->WidgetToTiles(dx);
+		privateData->currentY = privateData->preMoveY - privateData->WidgetToTiles(dy);
 		iridescent_map_view_changed(widget);
 		gtk_widget_queue_draw (widget);
 	}
@@ -406,6 +373,21 @@ void iridescent_map_realize(GtkWidget *widget)
 	iridescent_map_view_changed(widget);
 }
 
+void iridescent_map_map(GtkWidget *widget)
+{
+	GTK_WIDGET_CLASS (iridescent_map_parent_class)->map (widget);
+
+	//Visible views are served first by the tile service
+	iridescent_map_view_changed(widget);
+}
+
+void iridescent_map_unmap(GtkWidget *widget)
+{
+	GTK_WIDGET_CLASS (iridescent_map_parent_class)->unmap (widget);
+
+	iridescent_map_view_changed(widget);
+}
+
 gboolean iridescent_map_scroll_event (GtkWidget *widget,
 	GdkEventScroll *event)
 {
@@ -414,7 +396,6 @@ gboolean iridescent_map_scroll_event (GtkWidget *widget,
 	_IridescentMapPrivate *privateData = (_IridescentMapPrivate *)self->privateData;
 
 	GdkScrollDirection &direction = event->direction;
-	g_mutex_lock (privateData->mutex);
 	if(direction == GDK_SCROLL_UP)
 	{
 		privateData->currentZoom = round(privateData->currentZoom) + 1;
@@ -430,7 +411,6 @@ gboolean iridescent_map_scroll_event (GtkWidget *widget,
 			privateData->currentY /= 2;
 		}
 	}
-	g_mutex_unlock (privateData->mutex);
 
 	//Plan what work needs doing at the new zoom level
 	iridescent_map_view_changed(widget);
@@ -440,12 +420,95 @@ gboolean iridescent_map_scroll_event (GtkWidget *widget,
 }
 
 
+static void iridescent_map_set_archive (GObject *object, _IridescentMapPrivate *priv, const gchar *filename)
+{
+	std::string newFilename = filename != NULL ? filename : "";
+	if(newFilename == priv->archiveFilename)
+		return;
+
+	std::shared_ptr<class TileArchive> archive;
+	int archiveTilePixels = 0;
+	if(newFilename.size() > 0)
+	{
+		try
+		{
+			archive = std::make_shared<class TileArchive>(newFilename.c_str(), false);
+			//Written by the seed tool, so tiles that would be enlarged can be rendered instead
+			archiveTilePixels = atoi(archive->GetMetadata("tile_size").c_str());
+		}
+		catch(runtime_error &err)
+		{
+			g_warning("%s", err.what());
+			return;
+		}
+	}
+
+	//Only tiles that have not been rendered yet will come from the archive
+	priv->archiveFilename = newFilename;
+	TileService::GetInstance().SetViewArchive(priv->viewId, archive, archiveTilePixels);
+	iridescent_map_view_changed(GTK_WIDGET(object));
+	g_object_notify_by_pspec (object, obj_properties[PROP_TILE_ARCHIVE]);
+}
+
+static void iridescent_map_set_property (GObject *object,
+	guint property_id,
+	const GValue *value,
+	GParamSpec *pspec)
+{
+	IridescentMap *self = IRIDESCENT_MAP(object);
+	_IridescentMapPrivate *priv = (_IridescentMapPrivate *)self->privateData;
+
+	switch (property_id)
+	{
+	case PROP_TILE_ARCHIVE:
+		if(priv != NULL)
+			iridescent_map_set_archive(object, priv, g_value_get_string(value));
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+		break;
+	}
+}
+
+static void iridescent_map_get_property (GObject *object,
+	guint property_id,
+	GValue *value,
+	GParamSpec *pspec)
+{
+	IridescentMap *self = IRIDESCENT_MAP(object);
+	_IridescentMapPrivate *priv = (_IridescentMapPrivate *)self->privateData;
+
+	switch (property_id)
+	{
+	case PROP_TILE_ARCHIVE:
+		g_value_set_string (value, (priv != NULL && priv->archiveFilename.size() > 0) ? priv->archiveFilename.c_str() : NULL);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+		break;
+	}
+}
+
 static void iridescent_map_class_init( IridescentMapClass* klass )
 {
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
+	object_class->set_property = iridescent_map_set_property;
+	object_class->get_property = iridescent_map_get_property;
+
+	//A raster MBTiles file, such as one made by the seed tool
+	obj_properties[PROP_TILE_ARCHIVE] = g_param_spec_string ("tile-archive",
+		"Tile archive",
+		"MBTiles file of pre-rendered tiles to use before rendering",
+		NULL,
+		(GParamFlags)(G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY));
+	g_object_class_install_properties (object_class, N_PROPERTIES, obj_properties);
+
 	GtkWidgetClass *widget_class = (GtkWidgetClass*) klass;
 	widget_class->get_preferred_height = iridescent_map_get_preferred_height;
 	widget_class->get_preferred_width = iridescent_map_get_preferred_width;
 	widget_class->realize = iridescent_map_realize;
+	widget_class->map = iridescent_map_map;
+	widget_class->unmap = iridescent_map_unmap;
 	widget_class->draw = iridescent_map_draw;
 	widget_class->destroy = iridescent_map_destroy;
 	widget_class->button_press_event = iridescent_map_button_press_event;
@@ -463,270 +526,34 @@ static gboolean iridescent_map_resources_changed (gpointer data)
 	return G_SOURCE_REMOVE;
 }
 
+static void iridescent_map_scale_factor_changed (GObject *object, GParamSpec *pspec, gpointer data)
+{
+	//Render tiles again at the new device resolution
+	iridescent_map_view_changed(GTK_WIDGET(object));
+	gtk_widget_queue_draw (GTK_WIDGET(object));
+}
+
 static void iridescent_map_view_changed (GtkWidget *widget)
 {
 	IridescentMap *self = IRIDESCENT_MAP(widget);
 	_IridescentMapPrivate *priv = (_IridescentMapPrivate *)self->privateData;
+	if(priv == NULL)
+		return; //Widget is being destroyed
 
 	GtkAllocation allocation;
 	gtk_widget_get_allocation (widget,
                                &allocation);
 
-	double halfWidthNumTiles = allocation.width / (640.0 * 2.0);
-	double halfHeightNumTiles = allocation.height / (640.0 * 2.0);
-
-	g_mutex_lock (priv->mutex);
-	int minx = priv->currentX - halfWidthNumTiles;
-	int maxx = priv->currentX + halfWidthNumTiles;
-	int miny = priv->currentY - halfHeightNumTiles;
-	int maxy = priv->currentY + halfHeightNumTiles;
+	priv->scaleFactor = gtk_widget_get_scale_factor(widget);
+	int minx = 0, maxx = 0, miny = 0, maxy = 0;
+	priv->VisibleTiles(allocation, minx, maxx, miny, maxy);
 
 	priv->viewBbox.clear();
 	priv->viewBbox.push_back(minx);//left,bottom,right,top
 	priv->viewBbox.push_back(maxy);
 	priv->viewBbox.push_back(maxx);
 	priv->viewBbox.push_back(miny);
-	g_mutex_unlock (priv->mutex);
-	
-}
-
-void FindAvailableTask(class _IridescentMapPrivate *priv, enum TaskType &taskTypeOut, 
-	int &taskxOut, int &taskyOut, int &taskZoomOut)
-{
-	g_mutex_lock (priv->mutex);
-	if(priv->viewBbox.size() != 4)
-	{
-		g_mutex_unlock (priv->mutex);
-		return;
-	}
-	int minx = (int)floor(priv->viewBbox[0]);
-	int maxx = (int)ceil(priv->viewBbox[2]);
-	int miny = (int)floor(priv->viewBbox[3]);
-	int maxy = (int)ceil(priv->viewBbox[1]);
-	int roundedZoom = (int)round(priv->currentZoom);
-
-	map<int, map<int, Resource> > &resourcesAtZoom = priv->resources[roundedZoom];
-
-	//Tiles currently in view
-	for(int x = minx; x <= maxx; x++)
-	{
-		//Ensure column exists
-		map<int, Resource> &col = resourcesAtZoom[x];
-
-		for(int y = miny; y <= maxy; y++)
-		{
-			Resource &r = col[y];
-			if(!r.shapesSurfacePending && r.shapesSurface == NULL && !r.inputError)
-			{
-				r.shapesSurfacePending = true;
-				
-				taskxOut = x;
-				taskyOut = y;
-				taskZoomOut = roundedZoom;
-				taskTypeOut = TASK_SHAPES;
-				g_mutex_unlock (priv->mutex);
-				return;
-			}
-		}
-	}
-
-	//Tiles in view + a further tile in all directions
-	for(int x = minx-1; x <= maxx+1; x++)
-	{
-		//Ensure column exists
-		map<int, Resource> &col = resourcesAtZoom[x];
-
-		for(int y = miny-1; y <= maxy+1; y++)
-		{
-			Resource &r = col[y];
-			if(!r.shapesSurfacePending && r.shapesSurface == NULL && !r.inputError)
-			{
-				r.shapesSurfacePending = true;
-				
-				taskxOut = x;
-				taskyOut = y;
-				taskZoomOut = roundedZoom;
-				taskTypeOut = TASK_SHAPES;
-				g_mutex_unlock (priv->mutex);
-				return;
-			}
-		}
-	}
 
-	//Tiles currently in view
-	for(int x = minx; x <= maxx; x++)
-	{
-		//Ensure column exists
-		map<int, Resource> &col = resourcesAtZoom[x];
-
-		for(int y = miny; y <= maxy; y++)
-		{
-			Resource &r = col[y];
-			if(!r.labelsSurfacePending && r.labelsSurface == NULL && !r.inputError)
-			{
-				r.labelsSurfacePending = true;
-				
-				taskxOut = x;
-				taskyOut = y;
-				taskZoomOut = roundedZoom;
-				taskTypeOut = TASK_LABELS;
-				g_mutex_unlock (priv->mutex);
-				return;
-			}
-		}
-	}
-
-	//Limit the number of tiles in memory
-	//TODO
-
-	
-
-	g_mutex_unlock (priv->mutex);
-}
-
-gpointer WorkerThread (gpointer data)
-{
-	class _IridescentMapPrivate *priv = (class _IridescentMapPrivate *)data;
-	g_mutex_lock (priv->mutex);
-	bool stop = priv->stopWorker;
-	g_mutex_unlock (priv->mutex);
-
-	CoastMap coastMap("iridescent-testdata/map.bin");
-	string resourceFilePath = "iridescent-testdata/";
-
-	while (!stop)
-	{
-		int taskx = 0, tasky = 0, taskZoom = 0;
-		enum TaskType taskType = TASK_INVALID; 
-		FindAvailableTask(priv, taskType, taskx, tasky, taskZoom);
-
-		//Perform task if one is available
-		if(taskType == TASK_SHAPES)
-		{
-			// ** Draw shape layer **
-			cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 640, 640);
-			cairo_surface_t *roughLabelsSurface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 640, 640);
-			FeatureStore featureStore;
-			bool inputError = false;
-			int dataZoom = taskZoom;
-			int datax = taskx;
-			int datay = tasky;
-			try
-			{
-				//Convert request to zoom level 12
-				int reqZoom = taskZoom;
-				while(reqZoom > 12)
-				{
-					reqZoom --;
-					datax /= 2;
-					datay /= 2;
-				}
-
-				ReadInputO5m(reqZoom, "iridescent-testdata", datax, datay, featureStore);
-				dataZoom = reqZoom;
-			}
-			catch(runtime_error &err)
-			{
-				cout << "Error reading input: " << err.what() << endl;
-				inputError = true;
-			}
-
-			if(!inputError)
-			{
-				class DrawLibCairoPango drawlib(surface);	
-				class MapRender mapRender(&drawlib, taskx, tasky, taskZoom, datax, datay, dataZoom, resourceFilePath.c_str());
-				mapRender.SetCoastMap(coastMap);
-				LabelsByImportance organisedLabels;
-
-				//Render shapes
-				mapRender.Render(taskZoom, featureStore, true, true, organisedLabels);
-
-				//Do a rough render of labels
-				class DrawLibCairoPango drawlib2(roughLabelsSurface);
-				class MapRender roughLabelsRender(&drawlib2, taskx, tasky, taskZoom, datax, datay, dataZoom, resourceFilePath.c_str());
-				RenderLabelList labelList;
-				RenderLabelListOffsets labelOffsets;
-				labelList.push_back(organisedLabels);
-				labelOffsets.push_back(std::pair<double, double>(0.0, 0.0));
-				roughLabelsRender.RenderLabels(labelList, labelOffsets);
-
-				g_mutex_lock (priv->mutex);
-				class Resource rTmp;
-				priv->resources[taskZoom][taskx][tasky] = rTmp;
-				Resource &r = priv->resources[taskZoom][taskx][tasky];
-				r.labelsByImportance = organisedLabels;
-				r.shapesSurface = surface;
-				r.roughLabelsSurface = roughLabelsSurface;
-				r.shapesSurfacePending = false;
-				g_mutex_unlock (priv->mutex);
-
-				gdk_threads_add_idle (iridescent_map_resources_changed, data);		
-			}
-			else
-			{
-				g_mutex_lock (priv->mutex);
-				class Resource rTmp;
-				priv->resources[taskZoom][taskx][tasky] = rTmp;
-				Resource &r = priv->resources[taskZoom][taskx][tasky];
-				r.inputError = true;
-				r.shapesSurfacePending = false;
-				g_mutex_unlock (priv->mutex);
-			}
-		}
-
-		if(taskType == TASK_LABELS)
-		{
-			// ** Draw labels layer **
-
-			RenderLabelList labelList;
-			RenderLabelListOffsets labelOffsets;
-
-			for(int y2=tasky-1; y2<= tasky+1; y2++)
-			{
-				for(int x2=taskx-1; x2 <= taskx+1; x2++)
-				{
-					g_mutex_lock (priv->mutex);
-					map<int, Resource> &col = priv->resources[taskZoom][x2];
-					labelList.push_back(col[y2].labelsByImportance);
-					labelOffsets.push_back(std::pair<double, double>(640.0*(x2-taskx), 640.0*(y2-tasky)));
-					g_mutex_unlock (priv->mutex);
-				}
-			}
-
-			cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 640, 640);
-			class DrawLibCairoPango drawlib(surface);	
-			class MapRender mapRender(&drawlib, taskx, tasky, taskZoom, taskx, tasky, taskZoom, resourceFilePath.c_str());
-			mapRender.SetCoastMap(coastMap);
-			mapRender.RenderLabels(labelList, labelOffsets);
-
-			g_mutex_lock (priv->mutex);
-			Resource &r = priv->resources[taskZoom][taskx][tasky];
-			r.labelsSurface = surface;
-			r.labelsSurfacePending = false;
-			if(r.roughLabelsSurface != NULL)
-				cairo_surface_destroy(r.roughLabelsSurface);
-			r.roughLabelsSurface = NULL;
-			g_mutex_unlock (priv->mutex);
-
-			gdk_threads_add_idle (iridescent_map_resources_changed, data);
-
-		}
-
-		//Wait for a while, unless signalled by a condition
-		gint64 end_time;
-		if(taskType == TASK_INVALID)
-			end_time = g_get_monotonic_time () + 1 * G_TIME_SPAN_SECOND; //Slow wait
-		else
-			end_time = g_get_monotonic_time () + 10 * G_TIME_SPAN_MILLISECOND; //Fast wait
-
-		g_mutex_lock (priv->mutex);
-		g_cond_wait_until (priv->stopWorkerCond,
-                   priv->mutex,
-                   end_time);
-		stop = priv->stopWorker;
-		g_mutex_unlock (priv->mutex);
-	}
-
-	return 0;
+	TileService::GetInstance().SetView(priv->viewId, priv->TilePixels(), (int)round(priv->currentZoom), 
+		priv->viewBbox, gtk_widget_get_mapped(widget));
 }
-
@@ -0,0 +1,404 @@
+//Pre-renders an area into a raster MBTiles archive that the map widget can read
+//with its tile-archive property.
+
+#include <glib.h>
+#include <iostream>
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <stdexcept>
+#include <vector>
+#include <map>
+#include <deque>
+#include <memory>
+#include <unistd.h>
+
+#include "tile-render.h"
+#include "tile-archive.h"
+
+using namespace std;
+
+static const char *dataPath = "iridescent-testdata";
+static const char *style = "iridescent-testdata/";
+
+typedef std::pair<int, int> IntPair; //x, y
+
+class SeedTile
+{
+public:
+	cairo_surface_t *shapesSurface;
+	SharedLabels labels;
+	bool inputError;
+	int labelUsers; //Label tiles that have not yet used this tile's labels
+
+	SeedTile()
+	{
+		shapesSurface = NULL;
+		inputError = false;
+		labelUsers = 0;
+	}
+};
+
+//One zoom level of work, shared by a pool of threads. Shapes are handed out row 
+//by row; a tile's labels are handed out as soon as the shapes on every side of 
+//it are done, and take priority so finished tiles leave memory quickly.
+class SeedZoomJob
+{
+public:
+	class TileArchive *archive;
+	int zoom, tilePixels;
+	int minx, maxx, miny, maxy; //Tiles that go in the archive
+
+	//Start of memory protected resources
+	GMutex mutex;
+	GCond workCond;
+	std::map<IntPair, class SeedTile> tiles; //Only tiles in progress
+	std::map<IntPair, int> shapesAround; //Finished shapes around tiles waiting for labels
+	std::deque<IntPair> readyLabels;
+	int nextShapes, numShapes; //Shapes cover the archive plus a ring of neighbours
+	std::map<int, int> labelsLeftInRow;
+	int tilesWritten;
+	//End of memory protected resources
+
+	SeedZoomJob();
+	virtual ~SeedZoomJob();
+	bool InArchive(int x, int y) const;
+};
+
+SeedZoomJob::SeedZoomJob()
+{
+	archive = NULL;
+	zoom = 0;
+	tilePixels = RENDER_TILE_SIZE;
+	minx = maxx = miny = maxy = 0;
+	nextShapes = numShapes = 0;
+	tilesWritten = 0;
+	g_mutex_init(&mutex);
+	g_cond_init(&workCond);
+}
+
+SeedZoomJob::~SeedZoomJob()
+{
+	g_cond_clear(&workCond);
+	g_mutex_clear(&mutex);
+}
+
+bool SeedZoomJob::InArchive(int x, int y) const
+{
+	return x >= minx && x <= maxx && y >= miny && y <= maxy;
+}
+
+static void LonLatToTile(double lon, double lat, int zoom, int &xOut, int &yOut)
+{
+	//Web Mercator stops short of the poles
+	lon = max(-180.0, min(180.0, lon));
+	lat = max(-85.0511, min(85.0511, lat));
+	double n = pow(2.0, zoom);
+	double latRad = lat * M_PI / 180.0;
+	xOut = (int)floor((lon + 180.0) / 360.0 * n);
+	yOut = (int)floor((1.0 - log(tan(latRad) + 1.0 / cos(latRad)) / M_PI) / 2.0 * n);
+	int maxTile = (int)n - 1;
+	xOut = max(0, min(maxTile, xOut));
+	yOut = max(0, min(maxTile, yOut));
+}
+
+static void SeedShapes(class SeedZoomJob &job, class SeedTile &tile, int x, int y)
+{
+	int dataZoom = 0, datax = 0, datay = 0;
+	TileDataCoords(job.zoom, x, y, dataZoom, datax, datay);
+
+	class FeatureStore featureStore;
+	if(!DecodeTile(dataPath, dataZoom, datax, datay, featureStore))
+	{
+		tile.inputError = true;
+		return;
+	}
+
+	//Tiles around the edge are only needed for their labels, so draw them small
+	bool inArchive = job.InArchive(x, y);
+	cairo_surface_t *surface = CreateTileSurface(inArchive ? job.tilePixels : 1);
+	LabelsByImportance labels;
+	RenderShapesTile(style, job.zoom, x, y, featureStore, surface, NULL, labels);
+	tile.labels = std::make_shared<const LabelsByImportance>(std::move(labels));
+
+	if(inArchive)
+		tile.shapesSurface = surface;
+	else
+		cairo_surface_destroy(surface);
+}
+
+static bool SeedLabels(class SeedZoomJob &job, cairo_surface_t *shapesSurface, 
+	const std::vector<SharedLabels> &neighbourLabels, int x, int y)
+{
+	if(shapesSurface == NULL)
+		return false;
+
+	cairo_surface_t *labelsSurface = CreateTileSurface(job.tilePixels);
+	RenderLabelsTile(style, job.zoom, x, y, neighbourLabels, labelsSurface);
+
+	//The archive holds finished tiles, so labels are drawn onto the shapes
+	cairo_t *cr = cairo_create(shapesSurface);
+	cairo_set_source_surface(cr, labelsSurface, 0.0, 0.0);
+	cairo_paint(cr);
+	cairo_destroy(cr);
+	cairo_surface_destroy(labelsSurface);
+
+	job.archive->WriteTile(job.zoom, x, y, shapesSurface);
+	return true;
+}
+
+static void ShapesDone(class SeedZoomJob &job, int x, int y)
+{
+	//Memory protected variables must already be locked by caller
+	for(int y2=y-1; y2<=y+1; y2++)
+	{
+		for(int x2=x-1; x2<=x+1; x2++)
+		{
+			if(!job.InArchive(x2, y2))
+				continue;
+			int &done = job.shapesAround[IntPair(x2, y2)];
+			done ++;
+			if(done < 9)
+				continue;
+			job.shapesAround.erase(IntPair(x2, y2));
+			job.readyLabels.push_back(IntPair(x2, y2));
+		}
+	}
+}
+
+static void LabelsDone(class SeedZoomJob &job, int x, int y, bool written)
+{
+	//Memory protected variables must already be locked by caller
+	class SeedTile &tile = job.tiles[IntPair(x, y)];
+	if(tile.shapesSurface != NULL)
+		cairo_surface_destroy(tile.shapesSurface);
+	tile.shapesSurface = NULL;
+
+	//Neighbours leave memory once every tile that places labels with them is done
+	for(int y2=y-1; y2<=y+1; y2++)
+	{
+		for(int x2=x-1; x2<=x+1; x2++)
+		{
+			std::map<IntPair, class SeedTile>::iterator it = job.tiles.find(IntPair(x2, y2));
+			if(it == job.tiles.end())
+				continue;
+			it->second.labelUsers --;
+			if(it->second.labelUsers <= 0)
+			{
+				if(it->second.shapesSurface != NULL)
+					cairo_surface_destroy(it->second.shapesSurface);
+				job.tiles.erase(it);
+			}
+		}
+	}
+
+	if(written)
+		job.tilesWritten ++;
+	int &rowLeft = job.labelsLeftInRow[y];
+	rowLeft --;
+	if(rowLeft <= 0)
+	{
+		job.labelsLeftInRow.erase(y);
+		cout << "Zoom " << job.zoom << ": " << job.tilesWritten << " of "
+			<< (job.maxx - job.minx + 1) * (job.maxy - job.miny + 1) << " tiles" << endl;
+	}
+}
+
+static gpointer SeedThread(gpointer data)
+{
+	class SeedZoomJob &job = *(class SeedZoomJob *)data;
+	int rowWidth = job.maxx - job.minx + 3;
+
+	g_mutex_lock (&job.mutex);
+	while(true)
+	{
+		//Shapes only run a few rows ahead of the lowest row still needing labels, 
+		//which keeps the number of tiles in memory bounded
+		int shapesRow = job.miny - 1 + job.nextShapes / rowWidth;
+		bool shapesAllowed = job.nextShapes < job.numShapes && (job.labelsLeftInRow.empty() 
+			|| shapesRow <= job.labelsLeftInRow.begin()->first + 3);
+
+		if(!job.readyLabels.empty())
+		{
+			IntPair pos = job.readyLabels.front();
+			job.readyLabels.pop_front();
+
+			std::vector<SharedLabels> neighbourLabels;
+			for(int y2=pos.second-1; y2<=pos.second+1; y2++)
+				for(int x2=pos.first-1; x2<=pos.first+1; x2++)
+					neighbourLabels.push_back(job.tiles[IntPair(x2, y2)].labels);
+			cairo_surface_t *shapesSurface = job.tiles[pos].shapesSurface;
+			g_mutex_unlock (&job.mutex);
+
+			//Nothing else uses this tile's shapes surface until its labels are done
+			bool written = false;
+			try
+			{
+				written = SeedLabels(job, shapesSurface, neighbourLabels, pos.first, pos.second);
+			}
+			catch(runtime_error &err)
+			{
+				cerr << "Tile " << job.zoom << "/" << pos.first << "/" << pos.second << ": " << err.what() << endl;
+			}
+			neighbourLabels.clear();
+
+			g_mutex_lock (&job.mutex);
+			LabelsDone(job, pos.first, pos.second, written);
+			g_cond_broadcast (&job.workCond);
+		}
+		else if(shapesAllowed)
+		{
+			int x = job.minx - 1 + job.nextShapes % rowWidth;
+			int y = shapesRow;
+			job.nextShapes ++;
+
+			//Count the archive tiles that will place labels with this one
+			class SeedTile &tile = job.tiles[IntPair(x, y)];
+			for(int y2=y-1; y2<=y+1; y2++)
+				for(int x2=x-1; x2<=x+1; x2++)
+					if(job.InArchive(x2, y2))
+						tile.labelUsers ++;
+			g_mutex_unlock (&job.mutex);
+
+			//Map nodes stay put while others are added or removed, and this tile
+			//is not used by anyone else until its shapes are done
+			try
+			{
+				SeedShapes(job, tile, x, y);
+			}
+			catch(runtime_error &err)
+			{
+				cerr << "Tile " << job.zoom << "/" << x << "/" << y << ": " << err.what() << endl;
+			}
+
+			g_mutex_lock (&job.mutex);
+			ShapesDone(job, x, y);
+			g_cond_broadcast (&job.workCond);
+		}
+		else if(job.labelsLeftInRow.empty())
+			break; //Every tile is written
+		else
+			g_cond_wait (&job.workCond, &job.mutex);
+	}
+	g_mutex_unlock (&job.mutex);
+	return 0;
+}
+
+//Labels need the tiles on every side, so a ring of tiles one wider than the 
+//archive area is drawn for its labels.
+static int SeedZoom(class TileArchive &archive, int zoom, int minx, int maxx, int miny, int maxy,
+	int tilePixels, int numThreads)
+{
+	class SeedZoomJob job;
+	job.archive = &archive;
+	job.zoom = zoom;
+	job.tilePixels = tilePixels;
+	job.minx = minx;
+	job.maxx = maxx;
+	job.miny = miny;
+	job.maxy = maxy;
+	job.numShapes = (maxx - minx + 3) * (maxy - miny + 3);
+	for(int y = miny; y <= maxy; y++)
+		job.labelsLeftInRow[y] = maxx - minx + 1;
+
+	std::vector<GThread *> threads;
+	for(int i=0; i<numThreads; i++)
+		threads.push_back(g_thread_new("IridescentMapSeed", SeedThread, &job));
+	for(size_t i=0; i<threads.size(); i++)
+		g_thread_join(threads[i]);
+
+	//Ring tiles whose labels had no archive tile to go in
+	for(std::map<IntPair, class SeedTile>::iterator it = job.tiles.begin(); it != job.tiles.end(); it++)
+		if(it->second.shapesSurface != NULL)
+			cairo_surface_destroy(it->second.shapesSurface);
+	return job.tilesWritten;
+}
+
+static void PrintUsage(const char *prog)
+{
+	cerr << "Usage: " << prog << " -b minlon,minlat,maxlon,maxlat -z minzoom[-maxzoom] -o out.mbtiles [-s tilepixels] [-j threads]" << endl;
+}
+
+int main(int argc, char **argv)
+{
+	double bbox[4] = {0.0, 0.0, 0.0, 0.0};
+	bool bboxSet = false;
+	int minZoom = -1, maxZoom = -1;
+	int tilePixels = RENDER_TILE_SIZE;
+	int numThreads = (int)g_get_num_processors();
+	const char *outFilename = NULL;
+
+	int opt;
+	while((opt = getopt(argc, argv, "b:z:o:s:j:")) != -1)
+	{
+		switch(opt)
+		{
+		case 'b':
+			bboxSet = sscanf(optarg, "%lf,%lf,%lf,%lf", &bbox[0], &bbox[1], &bbox[2], &bbox[3]) == 4;
+			break;
+		case 'z':
+			if(sscanf(optarg, "%d-%d", &minZoom, &maxZoom) == 1)
+				maxZoom = minZoom;
+			break;
+		case 'o':
+			outFilename = optarg;
+			break;
+		case 's':
+			tilePixels = atoi(optarg);
+			break;
+		case 'j':
+			numThreads = atoi(optarg);
+			break;
+		default:
+			PrintUsage(argv[0]);
+			return 1;
+		}
+	}
+
+	if(!bboxSet || minZoom < 0 || maxZoom < minZoom || outFilename == NULL || tilePixels <= 0 || numThreads <= 0)
+	{
+		PrintUsage(argv[0]);
+		return 1;
+	}
+	//Also rejects NaN
+	if(!(bbox[0] <= bbox[2]) || !(bbox[1] <= bbox[3]))
+	{
+		cerr << "Bounding box must be minlon,minlat,maxlon,maxlat" << endl;
+		return 1;
+	}
+
+	try
+	{
+		class TileArchive archive(outFilename, true);
+		archive.SetMetadata("name", outFilename);
+		archive.SetMetadata("type", "baselayer");
+		archive.SetMetadata("version", "1.0");
+		archive.SetMetadata("format", "png");
+		gchar *bounds = g_strdup_printf("%f,%f,%f,%f", bbox[0], bbox[1], bbox[2], bbox[3]);
+		archive.SetMetadata("bounds", bounds);
+		g_free(bounds);
+		archive.SetMetadata("minzoom", to_string(minZoom));
+		archive.SetMetadata("maxzoom", to_string(maxZoom));
+		archive.SetMetadata("tile_size", to_string(tilePixels)); //Lets viewers tell when they are resampling
+
+		for(int zoom = minZoom; zoom <= maxZoom; zoom++)
+		{
+			//Tile y increases southwards
+			int minx = 0, maxx = 0, miny = 0, maxy = 0;
+			LonLatToTile(bbox[0], bbox[3], zoom, minx, miny);
+			LonLatToTile(bbox[2], bbox[1], zoom, maxx, maxy);
+
+			archive.BeginBatch();
+			int count = SeedZoom(archive, zoom, minx, maxx, miny, maxy, tilePixels, numThreads);
+			archive.EndBatch();
+			cout << "Zoom " << zoom << " done, " << count << " tiles written" << endl;
+		}
+	}
+	catch(runtime_error &err)
+	{
+		cerr << err.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}
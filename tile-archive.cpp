@@ -0,0 +1,180 @@
+#include "tile-archive.h"
+#include <stdexcept>
+#include <cstring>
+
+using namespace std;
+
+static cairo_status_t WritePngToString(void *closure, const unsigned char *data, unsigned int length)
+{
+	std::string *out = (std::string *)closure;
+	out->append((const char *)data, length);
+	return CAIRO_STATUS_SUCCESS;
+}
+
+class PngReadBuffer
+{
+public:
+	const unsigned char *data;
+	size_t length, pos;
+};
+
+static cairo_status_t ReadPngFromBuffer(void *closure, unsigned char *data, unsigned int length)
+{
+	class PngReadBuffer *buff = (class PngReadBuffer *)closure;
+	if(buff->pos + length > buff->length)
+		return CAIRO_STATUS_READ_ERROR;
+	memcpy(data, buff->data + buff->pos, length);
+	buff->pos += length;
+	return CAIRO_STATUS_SUCCESS;
+}
+
+static int TileRow(int zoom, int y)
+{
+	//MBTiles numbers rows from the bottom
+	return (1 << zoom) - 1 - y;
+}
+
+TileArchive::TileArchive(const char *filename, bool writable)
+{
+	g_mutex_init(&this->mutex);
+	this->db = NULL;
+	int flags = writable ? (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE) : SQLITE_OPEN_READONLY;
+	if(sqlite3_open_v2(filename, &this->db, flags, NULL) != SQLITE_OK)
+	{
+		string err = string("Cannot open tile archive ") + filename + ": " + sqlite3_errmsg(this->db);
+		sqlite3_close(this->db);
+		g_mutex_clear(&this->mutex);
+		throw runtime_error(err);
+	}
+
+	if(writable)
+	{
+		Exec("CREATE TABLE IF NOT EXISTS metadata (name text, value text);");
+		Exec("CREATE UNIQUE INDEX IF NOT EXISTS name ON metadata (name);");
+		Exec("CREATE TABLE IF NOT EXISTS tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob);");
+		Exec("CREATE UNIQUE INDEX IF NOT EXISTS tile_index ON tiles (zoom_level, tile_column, tile_row);");
+	}
+}
+
+TileArchive::~TileArchive()
+{
+	sqlite3_close(this->db);
+	this->db = NULL;
+	g_mutex_clear(&this->mutex);
+}
+
+void TileArchive::Exec(const char *sql)
+{
+	char *errmsg = NULL;
+	g_mutex_lock (&this->mutex);
+	int ret = sqlite3_exec(this->db, sql, NULL, NULL, &errmsg);
+	g_mutex_unlock (&this->mutex);
+	if(ret != SQLITE_OK)
+	{
+		string err = string("Tile archive error: ") + (errmsg != NULL ? errmsg : "unknown");
+		sqlite3_free(errmsg);
+		throw runtime_error(err);
+	}
+}
+
+void TileArchive::SetMetadata(const std::string &name, const std::string &value)
+{
+	g_mutex_lock (&this->mutex);
+	sqlite3_stmt *stmt = NULL;
+	int ret = sqlite3_prepare_v2(this->db, "INSERT OR REPLACE INTO metadata (name, value) VALUES (?, ?);", -1, &stmt, NULL);
+	if(ret == SQLITE_OK)
+	{
+		sqlite3_bind_text(stmt, 1, name.c_str(), -1, SQLITE_TRANSIENT);
+		sqlite3_bind_text(stmt, 2, value.c_str(), -1, SQLITE_TRANSIENT);
+		ret = sqlite3_step(stmt);
+	}
+	sqlite3_finalize(stmt);
+	g_mutex_unlock (&this->mutex);
+	if(ret != SQLITE_DONE)
+		throw runtime_error("Failed to write tile archive metadata");
+}
+
+std::string TileArchive::GetMetadata(const std::string &name)
+{
+	std::string value;
+	g_mutex_lock (&this->mutex);
+	sqlite3_stmt *stmt = NULL;
+	int ret = sqlite3_prepare_v2(this->db, "SELECT value FROM metadata WHERE name=?;", -1, &stmt, NULL);
+	if(ret == SQLITE_OK)
+	{
+		sqlite3_bind_text(stmt, 1, name.c_str(), -1, SQLITE_TRANSIENT);
+		if(sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_text(stmt, 0) != NULL)
+			value = (const char *)sqlite3_column_text(stmt, 0);
+	}
+	sqlite3_finalize(stmt);
+	g_mutex_unlock (&this->mutex);
+	return value;
+}
+
+void TileArchive::BeginBatch()
+{
+	Exec("BEGIN TRANSACTION;");
+}
+
+void TileArchive::EndBatch()
+{
+	Exec("COMMIT;");
+}
+
+void TileArchive::WriteTile(int zoom, int x, int y, cairo_surface_t *surface)
+{
+	//Encode before taking the lock, so several threads can compress at once
+	std::string png;
+	cairo_surface_flush(surface);
+	if(cairo_surface_write_to_png_stream(surface, WritePngToString, &png) != CAIRO_STATUS_SUCCESS)
+		throw runtime_error("Failed to encode tile");
+
+	g_mutex_lock (&this->mutex);
+	sqlite3_stmt *stmt = NULL;
+	int ret = sqlite3_prepare_v2(this->db, "INSERT OR REPLACE INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?, ?, ?, ?);", -1, &stmt, NULL);
+	if(ret == SQLITE_OK)
+	{
+		sqlite3_bind_int(stmt, 1, zoom);
+		sqlite3_bind_int(stmt, 2, x);
+		sqlite3_bind_int(stmt, 3, TileRow(zoom, y));
+		sqlite3_bind_blob(stmt, 4, png.data(), (int)png.size(), SQLITE_STATIC);
+		ret = sqlite3_step(stmt);
+	}
+	sqlite3_finalize(stmt);
+	g_mutex_unlock (&this->mutex);
+	if(ret != SQLITE_DONE)
+		throw runtime_error("Failed to write tile to archive");
+}
+
+cairo_surface_t *TileArchive::ReadTile(int zoom, int x, int y)
+{
+	std::string png;
+	g_mutex_lock (&this->mutex);
+	sqlite3_stmt *stmt = NULL;
+	int ret = sqlite3_prepare_v2(this->db, "SELECT tile_data FROM tiles WHERE zoom_level=? AND tile_column=? AND tile_row=?;", -1, &stmt, NULL);
+	if(ret == SQLITE_OK)
+	{
+		sqlite3_bind_int(stmt, 1, zoom);
+		sqlite3_bind_int(stmt, 2, x);
+		sqlite3_bind_int(stmt, 3, TileRow(zoom, y));
+		if(sqlite3_step(stmt) == SQLITE_ROW)
+			png.assign((const char *)sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0));
+	}
+	sqlite3_finalize(stmt);
+	g_mutex_unlock (&this->mutex);
+	if(png.size() == 0)
+		return NULL;
+
+	//Decode after releasing the lock
+	class PngReadBuffer buff;
+	buff.data = (const unsigned char *)png.data();
+	buff.length = png.size();
+	buff.pos = 0;
+	cairo_surface_t *surface = cairo_image_surface_create_from_png_stream(ReadPngFromBuffer, &buff);
+	if(cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS)
+	{
+		cairo_surface_destroy(surface);
+		return NULL;
+	}
+	return surface;
+}
@@ -0,0 +1,38 @@
+#ifndef _TILE_ARCHIVE_H
+#define _TILE_ARCHIVE_H
+
+#include <glib.h>
+#include <cairo.h>
+#include <sqlite3.h>
+#include <string>
+
+//A raster MBTiles file: PNG tiles in an SQLite database. Tiles are addressed with
+//the same x and y as the map; the flip to MBTiles rows is done internally.
+//Safe to use from several threads.
+class TileArchive
+{
+public:
+	//Throws runtime_error if the file cannot be opened
+	TileArchive(const char *filename, bool writable);
+	virtual ~TileArchive();
+
+	void SetMetadata(const std::string &name, const std::string &value);
+	//Returns an empty string if the name is not set
+	std::string GetMetadata(const std::string &name);
+
+	//Group many writes into one transaction
+	void BeginBatch();
+	void EndBatch();
+
+	void WriteTile(int zoom, int x, int y, cairo_surface_t *surface);
+	//Returns a new image surface, or NULL if the tile is not in the archive
+	cairo_surface_t *ReadTile(int zoom, int x, int y);
+
+private:
+	void Exec(const char *sql);
+
+	sqlite3 *db;
+	GMutex mutex;
+};
+
+#endif //_TILE_ARCHIVE_H
@@ -0,0 +1,141 @@
+#include <glib.h>
+#include "tile-render.h"
+#include <iostream>
+#include <stdexcept>
+#include <cmath>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "iridescent-map/drawlib/drawlibcairo.h"
+#include "iridescent-map/MapRender.h"
+
+using namespace std;
+
+//Coastline data is only read once loaded, so a single instance is shared by every
+//renderer in the process, widget workers and seed threads alike.
+static class CoastMap &GetSharedCoastMap()
+{
+	static gsize coastMapInitialised = 0;
+	static class CoastMap *coastMap = NULL;
+	if(g_once_init_enter(&coastMapInitialised))
+	{
+		coastMap = new class CoastMap("iridescent-testdata/map.bin");
+		g_once_init_leave(&coastMapInitialised, 1);
+	}
+	return *coastMap;
+}
+
+void TileDataCoords(int zoom, int x, int y, int &dataZoomOut, int &dataxOut, int &datayOut)
+{
+	//Convert request to zoom level 12
+	dataZoomOut = zoom;
+	dataxOut = x;
+	datayOut = y;
+	while(dataZoomOut > 12)
+	{
+		dataZoomOut --;
+		dataxOut /= 2;
+		datayOut /= 2;
+	}
+}
+
+std::string TileDataPath(const char *dataPath, int zoom, int x, int y)
+{
+	//Expected to match the files ReadInputO5m reads. It is only used for
+	//prefetching, so a mismatch costs the prefetch and nothing else.
+	gchar *path = g_strdup_printf("%s/%d/%d/%d.o5m.gz", dataPath, zoom, x, y);
+	std::string out = path;
+	g_free(path);
+	return out;
+}
+
+void PrefetchTileData(const char *dataPath, int zoom, int x, int y)
+{
+	std::string path = TileDataPath(dataPath, zoom, x, y);
+	int fd = open(path.c_str(), O_RDONLY);
+	if(fd < 0)
+	{
+		cout << "Prefetch of " << path << " skipped: " << g_strerror(errno) << endl;
+		return;
+	}
+
+	//Only starts the read; the decoder blocks on whatever has not arrived yet
+	int ret = posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	if(ret != 0)
+		cout << "Prefetch of " << path << " failed: " << g_strerror(ret) << endl;
+	close(fd);
+}
+
+bool DecodeTile(const char *dataPath, int zoom, int x, int y, class FeatureStore &featureStoreOut)
+{
+	try
+	{
+		ReadInputO5m(zoom, dataPath, x, y, featureStoreOut);
+	}
+	catch(runtime_error &err)
+	{
+		cout << "Error reading input: " << err.what() << endl;
+		return false;
+	}
+	return true;
+}
+
+void RenderShapesTile(const char *style, int zoom, int x, int y, class FeatureStore &featureStore,
+	cairo_surface_t *shapesSurface, cairo_surface_t *roughLabelsSurface, LabelsByImportance &labelsOut)
+{
+	int dataZoom = 0, datax = 0, datay = 0;
+	TileDataCoords(zoom, x, y, dataZoom, datax, datay);
+
+	class DrawLibCairoPango drawlib(shapesSurface);
+	class MapRender mapRender(&drawlib, x, y, zoom, datax, datay, dataZoom, style);
+	mapRender.SetCoastMap(GetSharedCoastMap());
+	LabelsByImportance organisedLabels;
+
+	//Render shapes
+	mapRender.Render(zoom, featureStore, true, true, organisedLabels);
+
+	//Do a rough render of labels
+	RenderLabelList labelList(1);
+	RenderLabelListOffsets labelOffsets;
+	labelList[0] = std::move(organisedLabels);
+	labelOffsets.push_back(std::pair<double, double>(0.0, 0.0));
+	if(roughLabelsSurface != NULL)
+	{
+		class DrawLibCairoPango drawlib2(roughLabelsSurface);
+		class MapRender roughLabelsRender(&drawlib2, x, y, zoom, datax, datay, dataZoom, style);
+		roughLabelsRender.RenderLabels(labelList, labelOffsets);
+	}
+
+	labelsOut = std::move(labelList[0]);
+}
+
+cairo_surface_t *CreateTileSurface(int pixels)
+{
+	cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, pixels, pixels);
+	double deviceScale = (double)pixels / RENDER_TILE_SIZE;
+	cairo_surface_set_device_scale(surface, deviceScale, deviceScale);
+	return surface;
+}
+
+void RenderLabelsTile(const char *style, int zoom, int x, int y, const std::vector<SharedLabels> &neighbourLabels,
+	cairo_surface_t *labelsSurface)
+{
+	//RenderLabelList in iridescent-map holds label sets by value, so each one is
+	//still deep copied here, once per label task that uses it. Removing this copy
+	//needs a RenderLabelList of shared pointers upstream.
+	RenderLabelList labelList(neighbourLabels.size());
+	RenderLabelListOffsets labelOffsets;
+	for(size_t i=0; i<neighbourLabels.size(); i++)
+	{
+		if(neighbourLabels[i])
+			labelList[i] = *neighbourLabels[i];
+		labelOffsets.push_back(std::pair<double, double>(
+			RENDER_TILE_SIZE * ((int)i % 3 - 1.0), RENDER_TILE_SIZE * ((int)i / 3 - 1.0)));
+	}
+
+	class DrawLibCairoPango drawlib(labelsSurface);
+	class MapRender mapRender(&drawlib, x, y, zoom, x, y, zoom, style);
+	mapRender.SetCoastMap(GetSharedCoastMap());
+	mapRender.RenderLabels(labelList, labelOffsets);
+}
@@ -0,0 +1,48 @@
+#ifndef _TILE_RENDER_H
+#define _TILE_RENDER_H
+
+#include <cairo.h>
+#include <string>
+#include <memory>
+#include <vector>
+
+#include "iridescent-map/LabelEngine.h"
+#include "iridescent-map/ReadInputO5m.h"
+#include "iridescent-map/Coast.h"
+
+//The steps of producing one tile, shared by the widget's tile service and
+//offline tools. Each step can run on its own thread.
+
+//MapRender draws a tile in a square of this many user space units. Surfaces at
+//other pixel sizes use a cairo device scale to map onto it.
+#define RENDER_TILE_SIZE 640
+
+//Label sets are immutable once a tile's shapes are drawn, so tiles hold them by
+//pointer. MapRender only takes label sets by value, see RenderLabelsTile.
+typedef std::shared_ptr<const LabelsByImportance> SharedLabels;
+
+//Source data is only stored at zoom 12 and below
+void TileDataCoords(int zoom, int x, int y, int &dataZoomOut, int &dataxOut, int &datayOut);
+std::string TileDataPath(const char *dataPath, int zoom, int x, int y);
+
+//Start reading a tile's source file in the background, so a later decode finds
+//it in the page cache. Only a hint: failures are reported, and DecodeTile decides
+//whether the input is missing.
+void PrefetchTileData(const char *dataPath, int zoom, int x, int y);
+
+//Returns false if the source data could not be read
+bool DecodeTile(const char *dataPath, int zoom, int x, int y, class FeatureStore &featureStoreOut);
+
+void RenderShapesTile(const char *style, int zoom, int x, int y, class FeatureStore &featureStore,
+	cairo_surface_t *shapesSurface, cairo_surface_t *roughLabelsSurface, LabelsByImportance &labelsOut);
+
+//A square tile surface of the given size in device pixels. Its user space is
+//always RENDER_TILE_SIZE units across, so tiles draw the same at any resolution.
+cairo_surface_t *CreateTileSurface(int pixels);
+
+//Places a tile's labels together with those of the tiles around it. The nine label
+//sets are given row by row from the top left; empty pointers have no labels.
+void RenderLabelsTile(const char *style, int zoom, int x, int y, const std::vector<SharedLabels> &neighbourLabels,
+	cairo_surface_t *labelsSurface);
+
+#endif //_TILE_RENDER_H
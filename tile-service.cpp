@@ -0,0 +1,909 @@
+#include <gtk/gtk.h>
+#include "tile-service.h"
+#include <iostream>
+#include <cmath>
+#include <stdexcept>
+#include <algorithm>
+#include <set>
+
+#include "tile-render.h"
+#include "tile-archive.h"
+
+using namespace std;
+
+static const char *dataPath = "iridescent-testdata";
+
+Resource::Resource()
+{
+	shapesSurface = NULL;
+	shapesSurfacePending = false;
+	roughLabelsSurface= NULL;
+	labelsSurface = NULL;
+	draftShapesSurface = NULL;
+	labelsSurfacePending = false;
+	inputError = false;
+	labelsInShapes = false;
+	shapeTaskAssigned = false;
+	labelTaskAssigned = false;
+}
+
+Resource::Resource(class Resource &&a)
+{
+	shapesSurface = NULL;
+	roughLabelsSurface = NULL;
+	labelsSurface = NULL;
+	draftShapesSurface = NULL;
+	*this = std::move(a);
+}
+
+Resource::~Resource()
+{
+	ReleaseSurfaces();
+}
+
+class Resource& Resource::operator=(class Resource &&a)
+{
+	if(this == &a)
+		return *this;
+	ReleaseSurfaces();
+
+	shapesSurface = a.shapesSurface;
+	roughLabelsSurface = a.roughLabelsSurface;
+	labelsSurface = a.labelsSurface;
+	draftShapesSurface = a.draftShapesSurface;
+	a.shapesSurface = NULL;
+	a.roughLabelsSurface = NULL;
+	a.labelsSurface = NULL;
+	a.draftShapesSurface = NULL;
+
+	labelsByImportance = std::move(a.labelsByImportance);
+	labelsSurfacePending = a.labelsSurfacePending;
+	shapesSurfacePending = a.shapesSurfacePending;
+	inputError = a.inputError;
+	labelsInShapes = a.labelsInShapes;
+	shapeTaskAssigned = a.shapeTaskAssigned;
+	labelTaskAssigned = a.labelTaskAssigned;
+	return *this;
+}
+
+void Resource::SetSurface(int layer, cairo_surface_t *surface)
+{
+	cairo_surface_t **slot = NULL;
+	if(layer == WIDGET_LAYER_SHAPES) slot = &shapesSurface;
+	if(layer == WIDGET_LAYER_LABELS) slot = &labelsSurface;
+	if(layer == WIDGET_LAYER_ROUGH_LABELS) slot = &roughLabelsSurface;
+	if(layer == WIDGET_LAYER_DRAFT_SHAPES) slot = &draftShapesSurface;
+	if(slot == NULL)
+		throw invalid_argument("Unknown layer");
+
+	if(*slot != NULL)
+		cairo_surface_destroy(*slot);
+	*slot = surface;
+}
+
+cairo_surface_t *Resource::GetSurface(int layer) const
+{
+	cairo_surface_t *surface = NULL;
+	if(layer == WIDGET_LAYER_SHAPES) surface = shapesSurface;
+	if(layer == WIDGET_LAYER_LABELS) surface = labelsSurface;
+	if(layer == WIDGET_LAYER_ROUGH_LABELS) surface = roughLabelsSurface;
+	if(layer == WIDGET_LAYER_DRAFT_SHAPES) surface = draftShapesSurface;
+	if(surface == NULL)
+		return NULL;
+	return cairo_surface_reference(surface);
+}
+
+void Resource::ReleaseSurfaces()
+{
+	labelsByImportance.reset();
+
+	if(shapesSurface != NULL)
+		cairo_surface_destroy(shapesSurface);
+	shapesSurface = NULL;
+	if(roughLabelsSurface != NULL)
+		cairo_surface_destroy(roughLabelsSurface);
+	roughLabelsSurface = NULL;
+	if(labelsSurface != NULL)
+		cairo_surface_destroy(labelsSurface);
+	labelsSurface = NULL;
+	if(draftShapesSurface != NULL)
+		cairo_surface_destroy(draftShapesSurface);
+	draftShapesSurface = NULL;
+}
+
+// ************************************************************
+
+StyleKey::StyleKey()
+{
+	tilePixels = RENDER_TILE_SIZE;
+}
+
+StyleKey::StyleKey(const std::string &style, int tilePixels)
+{
+	this->style = style;
+	this->tilePixels = tilePixels;
+}
+
+bool StyleKey::operator<(const class StyleKey &other) const
+{
+	if(style != other.style)
+		return style < other.style;
+	return tilePixels < other.tilePixels;
+}
+
+bool StyleKey::operator==(const class StyleKey &other) const
+{
+	return style == other.style && tilePixels == other.tilePixels;
+}
+
+// ************************************************************
+
+TileView::TileView()
+{
+	tilePixels = RENDER_TILE_SIZE;
+	hasFallback = false;
+	archiveTilePixels = 0;
+	zoom = 0;
+	visible = false;
+	lastServed = 0;
+	changedFunc = NULL;
+	userData = NULL;
+}
+
+StyleKey TileView::Key() const
+{
+	return StyleKey(style, tilePixels);
+}
+
+TileTask::TileTask()
+{
+	type = TASK_INVALID;
+	x = 0;
+	y = 0;
+	zoom = 0;
+	archiveTilePixels = 0;
+}
+
+//A task in flight through the pipeline
+class TileJob
+{
+public:
+	class TileTask task;
+	int dataZoom, datax, datay;
+	FeatureStore featureStore;
+
+	TileJob(const class TileTask &task)
+	{
+		this->task = task;
+		TileDataCoords(task.zoom, task.x, task.y, this->dataZoom, this->datax, this->datay);
+	}
+};
+
+// ************************************************************
+
+class TileService &TileService::GetInstance()
+{
+	static gsize serviceInitialised = 0;
+	static class TileService *service = NULL;
+	if(g_once_init_enter(&serviceInitialised))
+	{
+		service = new class TileService();
+		g_once_init_leave(&serviceInitialised, 1);
+	}
+	return *service;
+}
+
+TileService::TileService()
+{
+	g_mutex_init(&this->mutex);
+	g_cond_init(&this->workCond);
+	this->stopWorkers = false;
+	this->nextViewId = 1;
+	this->serveCounter = 0;
+
+	//I/O mostly waits on the disk; decoding is lighter than rendering. One core 
+	//is left for the main loop.
+	int numCores = max(1, (int)g_get_num_processors() - 1);
+	this->numIoThreads = 2;
+	this->numDecodeThreads = max(1, numCores / 3);
+	this->numRenderThreads = max(1, numCores - this->numDecodeThreads);
+	this->ioQueue = NULL;
+	this->decodeQueue = NULL;
+	this->renderQueue = NULL;
+}
+
+TileService::~TileService()
+{
+	StopWorkers();
+	g_cond_clear(&this->workCond);
+	g_mutex_clear(&this->mutex);
+}
+
+int TileService::AddView(const std::string &style, GSourceFunc changedFunc, gpointer userData)
+{
+	g_mutex_lock (&this->mutex);
+	int viewId = this->nextViewId;
+	this->nextViewId ++;
+	class TileView &view = this->views[viewId];
+	view.style = style;
+	view.changedFunc = changedFunc;
+	view.userData = userData;
+	bool firstView = this->views.size() == 1;
+	g_mutex_unlock (&this->mutex);
+
+	if(firstView)
+		StartWorkers();
+	return viewId;
+}
+
+void TileService::RemoveView(int viewId)
+{
+	g_mutex_lock (&this->mutex);
+	this->views.erase(viewId);
+	bool lastView = this->views.empty();
+	g_mutex_unlock (&this->mutex);
+
+	if(lastView)
+	{
+		//Nothing left to render for, so release the workers and the cache
+		StopWorkers();
+		g_mutex_lock (&this->mutex);
+		this->resources.clear();
+		g_mutex_unlock (&this->mutex);
+		return;
+	}
+
+	g_mutex_lock (&this->mutex);
+	EvictUnusedKeys();
+	g_mutex_unlock (&this->mutex);
+}
+
+void TileService::SetView(int viewId, int tilePixels, int zoom, const std::vector<double> &viewBbox, bool visible)
+{
+	g_mutex_lock (&this->mutex);
+	std::map<int, class TileView>::iterator it = this->views.find(viewId);
+	if(it != this->views.end())
+	{
+		class TileView &view = it->second;
+		StyleKey oldKey = view.Key();
+		bool hadTiles = view.viewBbox.size() == 4;
+		view.tilePixels = tilePixels;
+		view.zoom = zoom;
+		view.viewBbox = viewBbox;
+		view.visible = visible;
+
+		//Keep showing the oldest tiles that still cover the view
+		if(view.hasFallback && view.fallbackKey == view.Key())
+			view.hasFallback = false;
+		else if(hadTiles && !view.hasFallback && !(oldKey == view.Key()))
+		{
+			view.hasFallback = true;
+			view.fallbackKey = oldKey;
+		}
+		EvictUnusedKeys();
+	}
+	g_mutex_unlock (&this->mutex);
+
+	//Wake idle workers to plan for the new view
+	g_cond_broadcast (&this->workCond);
+}
+
+void TileService::SetViewArchive(int viewId, std::shared_ptr<class TileArchive> archive, int archiveTilePixels)
+{
+	g_mutex_lock (&this->mutex);
+	std::map<int, class TileView>::iterator it = this->views.find(viewId);
+	if(it != this->views.end())
+	{
+		it->second.archive = archive;
+		it->second.archiveTilePixels = archiveTilePixels;
+	}
+	g_mutex_unlock (&this->mutex);
+}
+
+void TileService::SetStageThreads(int numIoThreads, int numDecodeThreads, int numRenderThreads)
+{
+	this->numIoThreads = max(1, numIoThreads);
+	this->numDecodeThreads = max(1, numDecodeThreads);
+	this->numRenderThreads = max(1, numRenderThreads);
+}
+
+void TileService::GetStageThreads(int &numIoThreadsOut, int &numDecodeThreadsOut, int &numRenderThreadsOut) const
+{
+	numIoThreadsOut = this->numIoThreads;
+	numDecodeThreadsOut = this->numDecodeThreads;
+	numRenderThreadsOut = this->numRenderThreads;
+}
+
+void TileService::Lock()
+{
+	g_mutex_lock (&this->mutex);
+}
+
+void TileService::Unlock()
+{
+	g_mutex_unlock (&this->mutex);
+}
+
+Resources &TileService::GetResources(const StyleKey &key)
+{
+	//Memory protected variables must already be locked by caller
+	return this->resources[key];
+}
+
+Resources *TileService::FindResources(const StyleKey &key)
+{
+	//Memory protected variables must already be locked by caller
+	ResourcesByStyle::iterator it = this->resources.find(key);
+	if(it == this->resources.end())
+		return NULL;
+	return &it->second;
+}
+
+bool TileService::GetViewFallback(int viewId, StyleKey &keyOut)
+{
+	//Memory protected variables must already be locked by caller
+	std::map<int, class TileView>::iterator it = this->views.find(viewId);
+	if(it == this->views.end() || !it->second.hasFallback)
+		return false;
+	keyOut = it->second.fallbackKey;
+	return true;
+}
+
+class Resource *TileService::FindTile(const class TileTask &task)
+{
+	//Memory protected variables must already be locked by caller. Returns NULL
+	//if the task's cache was evicted while it was being worked on.
+	Resources *keyResources = FindResources(task.key);
+	if(keyResources == NULL)
+		return NULL;
+	return &(*keyResources)[task.zoom][task.x][task.y];
+}
+
+bool ViewCovered(Resources &resources, const class TileView &view)
+{
+	int minx = (int)floor(view.viewBbox[0]);
+	int maxx = (int)ceil(view.viewBbox[2]);
+	int miny = (int)floor(view.viewBbox[3]);
+	int maxy = (int)ceil(view.viewBbox[1]);
+	map<int, map<int, Resource> > &resourcesAtZoom = resources[view.zoom];
+	for(int x = minx; x <= maxx; x++)
+	{
+		map<int, Resource> &col = resourcesAtZoom[x];
+		for(int y = miny; y <= maxy; y++)
+		{
+			Resource &r = col[y];
+			if(r.shapesSurface == NULL && !r.inputError)
+				return false;
+		}
+	}
+	return true;
+}
+
+void TileService::ReleaseFallbacks()
+{
+	//Memory protected variables must already be locked by caller
+	bool released = false;
+	for(std::map<int, class TileView>::iterator it = this->views.begin(); it != this->views.end(); it++)
+	{
+		class TileView &view = it->second;
+		if(!view.hasFallback || view.viewBbox.size() != 4)
+			continue;
+		if(!ViewCovered(this->resources[view.Key()], view))
+			continue;
+		view.hasFallback = false;
+		released = true;
+	}
+	if(released)
+		EvictUnusedKeys();
+}
+
+void TileService::EvictUnusedKeys()
+{
+	//Memory protected variables must already be locked by caller
+	std::set<StyleKey> inUse;
+	for(std::map<int, class TileView>::iterator it = this->views.begin(); it != this->views.end(); it++)
+	{
+		inUse.insert(it->second.Key());
+		if(it->second.hasFallback)
+			inUse.insert(it->second.fallbackKey);
+	}
+
+	ResourcesByStyle::iterator it = this->resources.begin();
+	while(it != this->resources.end())
+	{
+		if(inUse.count(it->first) == 0)
+			it = this->resources.erase(it);
+		else
+			it++;
+	}
+}
+
+void TileService::StartWorkers()
+{
+	g_mutex_lock (&this->mutex);
+	this->stopWorkers = false;
+	g_mutex_unlock (&this->mutex);
+
+	//Enough queued work to keep the next stage busy, but no more
+	this->ioQueue = new BoundedQueue<class TileJob *>(this->numIoThreads * 2);
+	this->decodeQueue = new BoundedQueue<class TileJob *>(this->numDecodeThreads * 2);
+	this->renderQueue = new BoundedQueue<class TileJob *>(this->numRenderThreads * 2);
+
+	this->workers.push_back(g_thread_new("IridescentMapPlanner",
+		TileService::PlannerThread, this));
+	for(int i=0; i<this->numIoThreads; i++)
+		this->workers.push_back(g_thread_new("IridescentMapIo",
+			TileService::IoThread, this));
+	for(int i=0; i<this->numDecodeThreads; i++)
+		this->workers.push_back(g_thread_new("IridescentMapDecode",
+			TileService::DecodeThread, this));
+	for(int i=0; i<this->numRenderThreads; i++)
+		this->workers.push_back(g_thread_new("IridescentMapRender",
+			TileService::RenderThread, this));
+}
+
+void TileService::StopWorkers()
+{
+	g_mutex_lock (&this->mutex);
+	this->stopWorkers = true;
+	g_mutex_unlock (&this->mutex);
+	g_cond_broadcast (&this->workCond);
+	if(this->ioQueue != NULL)
+		this->ioQueue->Close();
+	if(this->decodeQueue != NULL)
+		this->decodeQueue->Close();
+	if(this->renderQueue != NULL)
+		this->renderQueue->Close();
+
+	for(size_t i=0; i<this->workers.size(); i++)
+	{
+		g_thread_join (this->workers[i]);
+	}
+	this->workers.clear();
+
+	//Discard work that was queued but not started
+	class TileJob *job = NULL;
+	if(this->ioQueue != NULL)
+	{
+		while(this->ioQueue->TryPop(job))
+			delete job;
+		delete this->ioQueue;
+	}
+	this->ioQueue = NULL;
+	if(this->decodeQueue != NULL)
+	{
+		while(this->decodeQueue->TryPop(job))
+			delete job;
+		delete this->decodeQueue;
+	}
+	this->decodeQueue = NULL;
+	if(this->renderQueue != NULL)
+	{
+		while(this->renderQueue->TryPop(job))
+			delete job;
+		delete this->renderQueue;
+	}
+	this->renderQueue = NULL;
+}
+
+bool ViewServeOrder(const class TileView *a, const class TileView *b)
+{
+	//Whichever view has waited longest goes first
+	return a->lastServed < b->lastServed;
+}
+
+bool TileService::FindAvailableTask(bool allowShapes, bool allowLabels, class TileTask &taskOut)
+{
+	//Memory protected variables must already be locked by caller
+	ReleaseFallbacks();
+
+	std::vector<class TileView *> ordered;
+	for(std::map<int, class TileView>::iterator it = this->views.begin(); it != this->views.end(); it++)
+		if(it->second.viewBbox.size() == 4)
+			ordered.push_back(&it->second);
+	std::sort(ordered.begin(), ordered.end(), ViewServeOrder);
+
+	//Visible views are served before hidden ones. Each pass is offered to every 
+	//view before moving on, so shapes in view are never held up by another 
+	//view's prefetching.
+	for(int visible = 1; visible >= 0; visible--)
+	{
+		for(int pass = 0; pass < 3; pass++)
+		{
+			if(!(pass == 2 ? allowLabels : allowShapes))
+				continue;
+			for(size_t i=0; i<ordered.size(); i++)
+			{
+				class TileView &view = *ordered[i];
+				if(view.visible != (visible == 1))
+					continue;
+				if(FindTaskInView(view, pass, taskOut))
+				{
+					this->serveCounter ++;
+					view.lastServed = this->serveCounter;
+					return true;
+				}
+			}
+		}
+	}
+
+	//Limit the number of tiles in memory
+	//TODO
+
+	return false;
+}
+
+bool NeighbourShapesReady(map<int, map<int, Resource> > &resourcesAtZoom, int x, int y)
+{
+	//Labels are placed using the labels of this and all adjacent tiles, so wait
+	//until other workers have finished those shapes
+	for(int x2=x-1; x2<=x+1; x2++)
+	{
+		map<int, Resource> &col = resourcesAtZoom[x2];
+		for(int y2=y-1; y2<=y+1; y2++)
+		{
+			Resource &r = col[y2];
+			if(r.shapesSurface == NULL && !r.inputError)
+				return false;
+		}
+	}
+	return true;
+}
+
+bool TileService::FindTaskInView(class TileView &view, int pass, class TileTask &taskOut)
+{
+	//Memory protected variables must already be locked by caller
+	int minx = (int)floor(view.viewBbox[0]);
+	int maxx = (int)ceil(view.viewBbox[2]);
+	int miny = (int)floor(view.viewBbox[3]);
+	int maxy = (int)ceil(view.viewBbox[1]);
+	int margin = 0;
+	if(pass == 1)
+		margin = 1; //Tiles in view + a further tile in all directions
+	bool labels = pass == 2;
+
+	map<int, map<int, Resource> > &resourcesAtZoom = this->resources[view.Key()][view.zoom];
+
+	for(int x = minx-margin; x <= maxx+margin; x++)
+	{
+		//Ensure column exists
+		map<int, Resource> &col = resourcesAtZoom[x];
+
+		for(int y = miny-margin; y <= maxy+margin; y++)
+		{
+			Resource &r = col[y];
+			if(r.inputError || (labels && r.labelsInShapes))
+				continue;
+
+			if(!labels && !r.shapesSurfacePending && r.shapesSurface == NULL)
+			{
+				r.shapesSurfacePending = true;
+				taskOut.type = TASK_SHAPES;
+			}
+			else if(labels && !r.labelsSurfacePending && r.labelsSurface == NULL 
+				&& NeighbourShapesReady(resourcesAtZoom, x, y))
+			{
+				r.labelsSurfacePending = true;
+				taskOut.type = TASK_LABELS;
+			}
+			else
+				continue;
+
+			taskOut.key = view.Key();
+			taskOut.x = x;
+			taskOut.y = y;
+			taskOut.zoom = view.zoom;
+			taskOut.archive = view.archive;
+			taskOut.archiveTilePixels = view.archiveTilePixels;
+			return true;
+		}
+	}
+	return false;
+}
+
+void TileService::RunShapesTask(class TileJob &job)
+{
+	const class TileTask &task = job.task;
+	// ** Draw shape layer **
+	cairo_surface_t *surface = CreateTileSurface(task.key.tilePixels);
+	cairo_surface_t *roughLabelsSurface = CreateTileSurface(task.key.tilePixels);
+	LabelsByImportance organisedLabels;
+	RenderShapesTile(task.key.style.c_str(), task.zoom, task.x, task.y, job.featureStore, 
+		surface, roughLabelsSurface, organisedLabels);
+	SharedLabels labels = std::make_shared<const LabelsByImportance>(std::move(organisedLabels));
+
+	//Update the cached tile in place, so a labels task that was planned meanwhile
+	//keeps its pending flag
+	g_mutex_lock (&this->mutex);
+	class Resource *r = FindTile(task);
+	if(r != NULL)
+	{
+		r->labelsByImportance = labels;
+		r->SetSurface(WIDGET_LAYER_SHAPES, surface);
+		r->SetSurface(WIDGET_LAYER_ROUGH_LABELS, roughLabelsSurface);
+		r->SetSurface(WIDGET_LAYER_DRAFT_SHAPES, NULL);
+		r->shapesSurfacePending = false;
+		NotifyViews(task.key, task.zoom);
+	}
+	else
+	{
+		cairo_surface_destroy(surface);
+		cairo_surface_destroy(roughLabelsSurface);
+	}
+	g_mutex_unlock (&this->mutex);
+
+	//Neighbouring labels may now be ready to plan
+	g_cond_broadcast (&this->workCond);
+}
+
+void TileService::PublishInputError(const class TileTask &task)
+{
+	g_mutex_lock (&this->mutex);
+	class Resource *r = FindTile(task);
+	if(r != NULL)
+	{
+		r->inputError = true;
+		r->shapesSurfacePending = false;
+	}
+	g_mutex_unlock (&this->mutex);
+	g_cond_broadcast (&this->workCond);
+}
+
+bool TileService::PublishFromArchive(const class TileJob &job)
+{
+	const class TileTask &task = job.task;
+	cairo_surface_t *image = task.archive->ReadTile(task.zoom, task.x, task.y);
+	if(image == NULL)
+		return false;
+
+	//Archives from before the tile size was recorded are judged by their images
+	int archivePixels = task.archiveTilePixels;
+	if(archivePixels <= 0)
+		archivePixels = cairo_image_surface_get_width(image);
+	bool upscaled = archivePixels < task.key.tilePixels;
+
+	//The decoded image is used as it is when it matches this view's tile size,
+	//otherwise it is resampled once into a tile surface
+	int imagePixels = cairo_image_surface_get_width(image);
+	cairo_surface_t *surface = image;
+	if(imagePixels == task.key.tilePixels && cairo_image_surface_get_height(image) == imagePixels)
+	{
+		double deviceScale = (double)imagePixels / RENDER_TILE_SIZE;
+		cairo_surface_set_device_scale(surface, deviceScale, deviceScale);
+	}
+	else
+	{
+		surface = CreateTileSurface(task.key.tilePixels);
+		cairo_t *cr = cairo_create(surface);
+		double imageScale = (double)RENDER_TILE_SIZE / imagePixels;
+		cairo_scale(cr, imageScale, imageScale);
+		cairo_set_source_surface(cr, image, 0.0, 0.0);
+		cairo_paint(cr);
+		cairo_destroy(cr);
+		cairo_surface_destroy(image);
+	}
+
+	if(upscaled)
+	{
+		//Too coarse for this view, so only shown until the tile is rendered
+		g_mutex_lock (&this->mutex);
+		class Resource *r = FindTile(task);
+		if(r != NULL)
+		{
+			r->SetSurface(WIDGET_LAYER_DRAFT_SHAPES, surface);
+			NotifyViews(task.key, task.zoom);
+		}
+		else
+			cairo_surface_destroy(surface);
+		g_mutex_unlock (&this->mutex);
+		return false;
+	}
+
+	g_mutex_lock (&this->mutex);
+	class Resource *r = FindTile(task);
+	if(r != NULL)
+	{
+		r->SetSurface(WIDGET_LAYER_SHAPES, surface);
+		r->SetSurface(WIDGET_LAYER_DRAFT_SHAPES, NULL);
+		r->labelsInShapes = true;
+		r->shapesSurfacePending = false;
+		NotifyViews(task.key, task.zoom);
+	}
+	else
+		cairo_surface_destroy(surface);
+	g_mutex_unlock (&this->mutex);
+	g_cond_broadcast (&this->workCond);
+	return true;
+}
+
+void TileService::RunLabelsTask(const class TileJob &job)
+{
+	// ** Draw labels layer **
+	const class TileTask &task = job.task;
+
+	//Take the neighbouring tiles' label sets under the lock, render after
+	//releasing it
+	std::vector<SharedLabels> neighbourLabels;
+
+	g_mutex_lock (&this->mutex);
+	Resources *keyResources = FindResources(task.key);
+	if(keyResources == NULL)
+	{
+		g_mutex_unlock (&this->mutex);
+		return; //No view uses these tiles any more
+	}
+	map<int, map<int, Resource> > &resourcesAtZoom = (*keyResources)[task.zoom];
+	for(int y2=task.y-1; y2<= task.y+1; y2++)
+	{
+		for(int x2=task.x-1; x2 <= task.x+1; x2++)
+		{
+			map<int, Resource> &col = resourcesAtZoom[x2];
+			neighbourLabels.push_back(col[y2].labelsByImportance);
+		}
+	}
+	g_mutex_unlock (&this->mutex);
+
+	cairo_surface_t *surface = CreateTileSurface(task.key.tilePixels);
+	RenderLabelsTile(task.key.style.c_str(), task.zoom, task.x, task.y, neighbourLabels, surface);
+
+	g_mutex_lock (&this->mutex);
+	class Resource *r = FindTile(task);
+	if(r != NULL)
+	{
+		r->SetSurface(WIDGET_LAYER_LABELS, surface);
+		r->SetSurface(WIDGET_LAYER_ROUGH_LABELS, NULL);
+		r->labelsSurfacePending = false;
+		NotifyViews(task.key, task.zoom);
+	}
+	else
+		cairo_surface_destroy(surface);
+	g_mutex_unlock (&this->mutex);
+}
+
+void TileService::NotifyViews(const StyleKey &key, int zoom)
+{
+	//Memory protected variables must already be locked by caller
+	for(std::map<int, class TileView>::iterator it = this->views.begin(); it != this->views.end(); it++)
+	{
+		class TileView &view = it->second;
+		//Views one level deeper may draw this tile while waiting for their own
+		if(!(view.Key() == key) || (view.zoom != zoom && view.zoom != zoom + 1))
+			continue;
+		gdk_threads_add_idle (TileService::DispatchChanged, GINT_TO_POINTER(it->first));
+	}
+}
+
+gboolean TileService::DispatchChanged(gpointer data)
+{
+	//Runs on the main loop, so the view cannot be removed while its callback runs
+	class TileService &service = TileService::GetInstance();
+	int viewId = GPOINTER_TO_INT(data);
+
+	g_mutex_lock (&service.mutex);
+	GSourceFunc changedFunc = NULL;
+	gpointer userData = NULL;
+	std::map<int, class TileView>::iterator it = service.views.find(viewId);
+	if(it != service.views.end())
+	{
+		changedFunc = it->second.changedFunc;
+		userData = it->second.userData;
+	}
+	g_mutex_unlock (&service.mutex);
+
+	if(changedFunc != NULL)
+		changedFunc(userData);
+	return G_SOURCE_REMOVE;
+}
+
+gpointer TileService::PlannerThread(gpointer data)
+{
+	//Picks the next tiles and routes them to the stage they need first. Queues are
+	//never waited on here, so a backlog of shapes cannot hold up labels.
+	class TileService *service = (class TileService *)data;
+	class TileJob *heldShapes = NULL, *heldLabels = NULL; //Planned, but their queue was full
+	g_mutex_lock (&service->mutex);
+	bool stop = service->stopWorkers;
+
+	while (!stop)
+	{
+		class TileTask task;
+		bool planned = (heldShapes == NULL || heldLabels == NULL)
+			&& service->FindAvailableTask(heldShapes == NULL, heldLabels == NULL, task);
+		g_mutex_unlock (&service->mutex);
+
+		if(planned && task.type == TASK_SHAPES)
+			heldShapes = new class TileJob(task);
+		if(planned && task.type == TASK_LABELS)
+			heldLabels = new class TileJob(task);
+
+		//Shapes start with reading their input, labels need no input
+		if(heldShapes != NULL && service->ioQueue->TryPush(heldShapes))
+			heldShapes = NULL;
+		if(heldLabels != NULL && service->renderQueue->TryPush(heldLabels))
+			heldLabels = NULL;
+
+		g_mutex_lock (&service->mutex);
+		stop = service->stopWorkers;
+		if(planned || stop)
+			continue;
+
+		//Wait for a view change or a finished tile. Queues do not signal when they 
+		//drain, so check back sooner while work is held.
+		gint64 waitTime = G_TIME_SPAN_SECOND;
+		if(heldShapes != NULL || heldLabels != NULL)
+			waitTime = 10 * G_TIME_SPAN_MILLISECOND;
+		gint64 end_time = g_get_monotonic_time () + waitTime;
+		g_cond_wait_until (&service->workCond,
+		           &service->mutex,
+		           end_time);
+		stop = service->stopWorkers;
+	}
+	g_mutex_unlock (&service->mutex);
+
+	delete heldShapes;
+	delete heldLabels;
+	return 0;
+}
+
+gpointer TileService::IoThread(gpointer data)
+{
+	//Reads pre-rendered tiles, or starts reading source data ahead of the decoders
+	class TileService *service = (class TileService *)data;
+	class TileJob *job = NULL;
+
+	while (service->ioQueue->Pop(job))
+	{
+		const class TileTask &task = job->task;
+		if(task.archive && service->PublishFromArchive(*job))
+		{
+			//Pre-rendered at this resolution, so nothing left for the other stages
+			delete job;
+			continue;
+		}
+
+		PrefetchTileData(dataPath, job->dataZoom, job->datax, job->datay);
+		if(!service->decodeQueue->Push(job))
+			delete job;
+	}
+
+	return 0;
+}
+
+gpointer TileService::DecodeThread(gpointer data)
+{
+	class TileService *service = (class TileService *)data;
+	class TileJob *job = NULL;
+
+	while (service->decodeQueue->Pop(job))
+	{
+		bool ok = DecodeTile(dataPath, job->dataZoom, job->datax, job->datay, job->featureStore);
+		if(!ok)
+		{
+			service->PublishInputError(job->task);
+			delete job;
+			continue;
+		}
+
+		if(!service->renderQueue->Push(job))
+			delete job;
+	}
+
+	return 0;
+}
+
+gpointer TileService::RenderThread(gpointer data)
+{
+	class TileService *service = (class TileService *)data;
+	class TileJob *job = NULL;
+
+	while (service->renderQueue->Pop(job))
+	{
+		if(job->task.type == TASK_SHAPES)
+			service->RunShapesTask(*job);
+		if(job->task.type == TASK_LABELS)
+			service->RunLabelsTask(*job);
+		delete job;
+	}
+
+	return 0;
+}
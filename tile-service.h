@@ -0,0 +1,184 @@
+#ifndef _TILE_SERVICE_H
+#define _TILE_SERVICE_H
+
+#include <glib.h>
+#include <cairo.h>
+#include <map>
+#include <vector>
+#include <string>
+#include <memory>
+
+#include "tile-render.h"
+#include "bounded-queue.h"
+
+enum WidgetLayers
+{
+	WIDGET_LAYER_SHAPES,
+	WIDGET_LAYER_ROUGH_LABELS,
+	WIDGET_LAYER_LABELS,
+	WIDGET_LAYER_DRAFT_SHAPES
+};
+
+//A rendered tile. Surfaces are owned references and the label set is immutable
+//once published, so tiles are moved into the cache and neighbours hold the label
+//set by pointer. It is only copied when labels are rendered, see RenderLabelsTile.
+class Resource
+{
+public:
+	SharedLabels labelsByImportance;
+	cairo_surface_t *roughLabelsSurface, *shapesSurface, *labelsSurface;
+	cairo_surface_t *draftShapesSurface; //Lower quality stand-in, shown until shapesSurface is ready
+	bool inputError;
+	//Loaded from a tile archive with labels already drawn. Archives keep no label 
+	//sets, so rendered neighbours place their labels without this tile's and may
+	//repeat or overlap its labels along the seam.
+	bool labelsInShapes;
+	bool labelsSurfacePending, shapesSurfacePending;
+	bool shapeTaskAssigned, labelTaskAssigned;
+
+	Resource();
+	Resource(class Resource &&a);
+	Resource(const class Resource &a) = delete;
+	virtual ~Resource();
+	class Resource& operator=(class Resource &&a);
+	class Resource& operator=(const class Resource &a) = delete;
+
+	//Takes ownership of the caller's reference, releasing any previous surface
+	void SetSurface(int layer, cairo_surface_t *surface);
+	//Returns a new reference (or NULL) that the caller must destroy
+	cairo_surface_t *GetSurface(int layer) const;
+
+private:
+	void ReleaseSurfaces();
+};
+
+typedef std::map<int, std::map<int, std::map<int, class Resource> > > Resources; //First index is zoom, then x, then y
+//Identifies one tile cache. Tiles are only shared between views that draw them
+//at the same resolution.
+class StyleKey
+{
+public:
+	std::string style;
+	int tilePixels; //Size of a tile in device pixels
+
+	StyleKey();
+	StyleKey(const std::string &style, int tilePixels);
+	bool operator<(const class StyleKey &other) const;
+	bool operator==(const class StyleKey &other) const;
+};
+
+typedef std::map<StyleKey, Resources> ResourcesByStyle;
+
+enum TaskType
+{
+	TASK_INVALID,
+	TASK_SHAPES,
+	TASK_LABELS
+};
+
+//A subscriber to the tile service, typically one map widget
+class TileView
+{
+public:
+	std::string style;
+	int tilePixels;
+	int zoom;
+	std::vector<double> viewBbox; //left,bottom,right,top
+	bool hasFallback;
+	StyleKey fallbackKey; //Tiles from before the last key change, drawn until the new ones are ready
+	bool visible;
+	std::shared_ptr<class TileArchive> archive; //Pre-rendered tiles, may be empty
+	int archiveTilePixels; //Size of the archive's map tiles, 0 if not known
+	gint64 lastServed; //Used to share workers fairly between views
+	GSourceFunc changedFunc; //Called on the main loop when tiles are published
+	gpointer userData;
+
+	TileView();
+	StyleKey Key() const;
+};
+
+class TileTask
+{
+public:
+	enum TaskType type;
+	StyleKey key;
+	int x, y, zoom;
+	std::shared_ptr<class TileArchive> archive;
+	int archiveTilePixels;
+
+	TileTask();
+};
+
+//Process-wide tile renderer shared by all map widgets. Each tile is rendered once
+//per (style key, zoom, x, y) into a common cache by a single worker pool, which is
+//scheduled across the subscribed views, visible views first. A single planner
+//picks tiles and hands them to the I/O, decode and render stages, each with its
+//own threads, so disk reads overlap with drawing.
+class TileService
+{
+public:
+	static class TileService &GetInstance();
+
+	//Views must be added, changed and removed from the main loop thread
+	int AddView(const std::string &style, GSourceFunc changedFunc, gpointer userData);
+	void RemoveView(int viewId);
+	//Changing the tile resolution keeps the view's previous tiles until the new
+	//ones cover it
+	void SetView(int viewId, int tilePixels, int zoom, const std::vector<double> &viewBbox, bool visible);
+	//Tiles found in the archive are used instead of rendering them. Archive tiles
+	//smaller than the view's map tiles are only shown until they are rendered.
+	void SetViewArchive(int viewId, std::shared_ptr<class TileArchive> archive, int archiveTilePixels);
+	//Threads per pipeline stage. Call from the main loop before the first view is
+	//added; running workers keep their current counts.
+	void SetStageThreads(int numIoThreads, int numDecodeThreads, int numRenderThreads);
+	void GetStageThreads(int &numIoThreadsOut, int &numDecodeThreadsOut, int &numRenderThreadsOut) const;
+
+	//The tile cache is shared with the workers, so hold the lock while reading it
+	void Lock();
+	void Unlock();
+	Resources &GetResources(const StyleKey &key);
+	//Returns NULL if no view uses the key
+	Resources *FindResources(const StyleKey &key);
+	bool GetViewFallback(int viewId, StyleKey &keyOut);
+
+private:
+	TileService();
+	virtual ~TileService();
+
+	void StartWorkers();
+	void StopWorkers();
+	bool FindAvailableTask(bool allowShapes, bool allowLabels, class TileTask &taskOut);
+	bool FindTaskInView(class TileView &view, int pass, class TileTask &taskOut);
+	void RunShapesTask(class TileJob &job);
+	void RunLabelsTask(const class TileJob &job);
+	void PublishInputError(const class TileTask &task);
+	bool PublishFromArchive(const class TileJob &job);
+	class Resource *FindTile(const class TileTask &task);
+	void ReleaseFallbacks();
+	void EvictUnusedKeys();
+	void NotifyViews(const StyleKey &key, int zoom);
+
+	//Pipeline stages, connected by bounded queues
+	static gpointer PlannerThread(gpointer data);
+	static gpointer IoThread(gpointer data);
+	static gpointer DecodeThread(gpointer data);
+	static gpointer RenderThread(gpointer data);
+	static gboolean DispatchChanged(gpointer data);
+
+	//Start of memory protected resources and controls
+	GMutex mutex;
+	GCond workCond;
+	bool stopWorkers;
+	std::map<int, class TileView> views;
+	int nextViewId;
+	gint64 serveCounter;
+	ResourcesByStyle resources;
+	//End of memory protected resources
+
+	//Only used from the main loop
+	int numIoThreads, numDecodeThreads, numRenderThreads;
+	std::vector<GThread *> workers;
+	BoundedQueue<class TileJob *> *ioQueue, *decodeQueue, *renderQueue;
+};
+
+#endif //_TILE_SERVICE_H